@@ -63,6 +63,17 @@ class aabb {
         return true;
     }
 
+    double surface_area() const {
+        if (x.size() < 0 || y.size() < 0 || z.size() < 0)
+            return 0;
+
+        return 2 * (x.size()*y.size() + y.size()*z.size() + z.size()*x.size());
+    }
+
+    point3 centroid() const {
+        return point3(0.5*(x.min + x.max), 0.5*(y.min + y.max), 0.5*(z.min + z.max));
+    }
+
     int longest_axis() const {
         if (x.size() > y.size())
             return x.size() > z.size() ? 0 : 2;
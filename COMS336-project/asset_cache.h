@@ -0,0 +1,73 @@
+#ifndef ASSET_CACHE_H
+#define ASSET_CACHE_H
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <typeindex>
+#include <typeinfo>
+#include <utility>
+
+// Loaded assets, such as meshes with their hierarchies, kept by type and path,
+// so scenes rendered one after the other in the same process load every file
+// once. Assets are made on the heap, not in a scene's arena, since they outlive
+// the scene that first asked for them. Images have a texture_registry of their
+// own.
+//
+// Like an arena, a cache is meant to be filled by one thread while scenes are
+// built.
+class asset_cache {
+  public:
+    template <typename T>
+    std::shared_ptr<T> get(const std::string& key, const std::function<std::shared_ptr<T>()>& load) {
+        auto& slot = assets[{std::type_index(typeid(T)), key}];
+        if (slot) {
+            reuses++;
+            return std::static_pointer_cast<T>(slot);
+        }
+
+        auto asset = load();
+        slot = asset;
+        loads++;
+        return asset;
+    }
+
+    int load_count() const { return loads; }
+    int reuse_count() const { return reuses; }
+
+    // While a scope is alive, cached_asset() on its thread goes through the
+    // given cache.
+    class scope {
+      public:
+        explicit scope(asset_cache& cache) : previous(current()) { current() = &cache; }
+        ~scope() { current() = previous; }
+
+        scope(const scope&) = delete;
+        scope& operator=(const scope&) = delete;
+
+      private:
+        asset_cache* previous;
+    };
+
+    static asset_cache*& current() {
+        thread_local asset_cache* cache = nullptr;
+        return cache;
+    }
+
+  private:
+    std::map<std::pair<std::type_index, std::string>, std::shared_ptr<void>> assets;
+    int loads = 0;
+    int reuses = 0;
+};
+
+// Returns the asset from the current thread's cache, or loads a private copy
+// when no cache scope is active.
+template <typename T>
+std::shared_ptr<T> cached_asset(const std::string& key, const std::function<std::shared_ptr<T>()>& load) {
+    if (auto* cache = asset_cache::current())
+        return cache->get<T>(key, load);
+    return load();
+}
+
+#endif
@@ -0,0 +1,232 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "camera.h"
+
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// One image to render: a scene, and camera settings that override the scene's
+// own, as "name=value" pairs.
+//
+// A job file holds one job per line, the scene number followed by its settings:
+//
+//     # figure 3 at two sizes, then a frame of figure 7 from another angle
+//     3 image_width=1920 samples_per_pixel=256 output=figure_3.png
+//     3 image_width=400 output=figure_3_small.png
+//     7 lookfrom=2,1,4 output=frames/0001.pfm
+//
+// Blank lines and lines starting with '#' are skipped. Vectors and colors are
+// written as three numbers separated by commas, and output also picks the
+// image format from the file's extension. A job without output writes its
+// image to stdout, so in a file of several jobs every job must set it.
+struct render_job {
+    int scene = 1;
+    std::vector<std::pair<std::string, std::string>> settings;
+};
+
+namespace batch {
+
+inline bool parse_number(const std::string& text, double& value) {
+    char* end = nullptr;
+    value = std::strtod(text.c_str(), &end);
+    return !text.empty() && *end == '\0';
+}
+
+inline bool parse_int(const std::string& text, int& value) {
+    double number;
+    if (!parse_number(text, number) || number != int(number))
+        return false;
+    value = int(number);
+    return true;
+}
+
+inline bool parse_bool(const std::string& text, bool& value) {
+    if (text == "1" || text == "true" || text == "on")   { value = true;  return true; }
+    if (text == "0" || text == "false" || text == "off") { value = false; return true; }
+    return false;
+}
+
+inline bool parse_vec3(const std::string& text, vec3& value) {
+    double e[3];
+    size_t start = 0;
+    for (int i = 0; i < 3; i++) {
+        size_t comma = i < 2 ? text.find(',', start) : text.size();
+        if (comma == std::string::npos || !parse_number(text.substr(start, comma - start), e[i]))
+            return false;
+        start = comma + 1;
+    }
+    value = vec3(e[0], e[1], e[2]);
+    return true;
+}
+
+inline bool parse_sampler(const std::string& text, sampler_type& value) {
+    static const std::map<std::string, sampler_type> names = {
+        {"independent", sampler_type::independent},
+        {"stratified",  sampler_type::stratified},
+        {"sobol",       sampler_type::sobol},
+        {"blue_noise",  sampler_type::blue_noise}
+    };
+    auto found = names.find(text);
+    if (found == names.end())
+        return false;
+    value = found->second;
+    return true;
+}
+
+typedef std::function<bool(camera&, const std::string&)> setter;
+
+// The camera settings a job may change, by name.
+inline const std::map<std::string, setter>& setters() {
+    static const std::map<std::string, setter> table = {
+        {"aspect_ratio",          [](camera& c, const std::string& s) { return parse_number(s, c.aspect_ratio); }},
+        {"image_width",           [](camera& c, const std::string& s) { return parse_int(s, c.image_width); }},
+        {"samples_per_pixel",     [](camera& c, const std::string& s) { return parse_int(s, c.samples_per_pixel); }},
+        {"max_depth",             [](camera& c, const std::string& s) { return parse_int(s, c.max_depth); }},
+        {"roulette_depth",        [](camera& c, const std::string& s) { return parse_int(s, c.roulette_depth); }},
+        {"background",            [](camera& c, const std::string& s) { return parse_vec3(s, c.background); }},
+        {"vfov",                  [](camera& c, const std::string& s) { return parse_number(s, c.vfov); }},
+        {"lookfrom",              [](camera& c, const std::string& s) { return parse_vec3(s, c.lookfrom); }},
+        {"lookat",                [](camera& c, const std::string& s) { return parse_vec3(s, c.lookat); }},
+        {"vup",                   [](camera& c, const std::string& s) { return parse_vec3(s, c.vup); }},
+        {"defocus_angle",         [](camera& c, const std::string& s) { return parse_number(s, c.defocus_angle); }},
+        {"focus_dist",            [](camera& c, const std::string& s) { return parse_number(s, c.focus_dist); }},
+        {"sampler",               [](camera& c, const std::string& s) { return parse_sampler(s, c.sampling); }},
+        {"light_sampling",        [](camera& c, const std::string& s) { return parse_bool(s, c.light_sampling); }},
+        {"thread_count",          [](camera& c, const std::string& s) { return parse_int(s, c.thread_count); }},
+        {"tile_size",             [](camera& c, const std::string& s) { return parse_int(s, c.tile_size); }},
+        {"samples_per_pass",      [](camera& c, const std::string& s) { return parse_int(s, c.samples_per_pass); }},
+        {"checkpoint",            [](camera& c, const std::string& s) { c.checkpoint_file = s; return true; }},
+        {"checkpoint_interval",   [](camera& c, const std::string& s) { return parse_number(s, c.checkpoint_interval); }},
+        {"adaptive",              [](camera& c, const std::string& s) { return parse_bool(s, c.adaptive); }},
+        {"adaptive_threshold",    [](camera& c, const std::string& s) { return parse_number(s, c.adaptive_threshold); }},
+        {"adaptive_min_samples",  [](camera& c, const std::string& s) { return parse_int(s, c.adaptive_min_samples); }},
+        {"max_samples_per_pixel", [](camera& c, const std::string& s) { return parse_int(s, c.max_samples_per_pixel); }},
+        {"sample_map",            [](camera& c, const std::string& s) { c.sample_map_file = s; return true; }},
+        {"denoise",               [](camera& c, const std::string& s) { return parse_bool(s, c.denoise); }},
+        {"albedo",                [](camera& c, const std::string& s) { c.albedo_file = s; return true; }},
+        {"normal",                [](camera& c, const std::string& s) { c.normal_file = s; return true; }},
+        {"depth",                 [](camera& c, const std::string& s) { c.depth_file = s; return true; }},
+        {"output",                [](camera& c, const std::string& s) {
+            c.output_file = s;
+            c.output_format = image_writer::format_for(s);
+            return true;
+        }}
+    };
+    return table;
+}
+
+}  // namespace batch
+
+// Reads a job from the scene number and settings in words.
+inline bool parse_job(const std::vector<std::string>& words, render_job& job) {
+    if (words.empty() || !batch::parse_int(words[0], job.scene)) {
+        std::cerr << "ERROR: A job must start with a scene number\n";
+        return false;
+    }
+
+    job.settings.clear();
+    for (size_t i = 1; i < words.size(); i++) {
+        auto equals = words[i].find('=');
+        if (equals == std::string::npos) {
+            std::cerr << "ERROR: Expected name=value, got '" << words[i] << "'\n";
+            return false;
+        }
+        job.settings.push_back({words[i].substr(0, equals), words[i].substr(equals + 1)});
+    }
+    return true;
+}
+
+// Whether the job names a file for its image. Without one the image goes to
+// stdout, where the images of several jobs would run together.
+inline bool has_output_file(const render_job& job) {
+    std::string output;
+    for (const auto& setting : job.settings) {
+        if (setting.first == "output")
+            output = setting.second;
+    }
+    return !output.empty();
+}
+
+// Reads a job file. A file with more than one job needs an output for each.
+inline bool read_jobs(const std::string& filename, std::vector<render_job>& jobs) {
+    std::ifstream in(filename);
+    if (!in) {
+        std::cerr << "ERROR: Could not open job file: " << filename << std::endl;
+        return false;
+    }
+
+    std::vector<int> lines;
+    std::string line;
+    for (int number = 1; std::getline(in, line); number++) {
+        std::istringstream words_in(line);
+        std::vector<std::string> words;
+        for (std::string word; words_in >> word; )
+            words.push_back(word);
+        if (words.empty() || words[0][0] == '#')
+            continue;
+
+        render_job job;
+        if (!parse_job(words, job)) {
+            std::cerr << "ERROR: In " << filename << " line " << number << std::endl;
+            return false;
+        }
+        jobs.push_back(job);
+        lines.push_back(number);
+    }
+
+    if (jobs.size() > 1) {
+        for (size_t i = 0; i < jobs.size(); i++) {
+            if (!has_output_file(jobs[i])) {
+                std::cerr << "ERROR: In " << filename << " line " << lines[i]
+                          << ": every job of a batch needs output=<file>" << std::endl;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// The jobs a command line asks for: none renders scene 1 to stdout, "--jobs
+// file" reads a job file, and anything else is a single job.
+inline bool jobs_from_arguments(int argc, char* argv[], std::vector<render_job>& jobs) {
+    if (argc < 2) {
+        jobs.push_back(render_job());
+        return true;
+    }
+
+    std::string first = argv[1];
+    if (first == "--jobs")
+        return argc == 3 && read_jobs(argv[2], jobs);
+
+    render_job job;
+    if (!parse_job(std::vector<std::string>(argv + 1, argv + argc), job))
+        return false;
+    jobs.push_back(job);
+    return true;
+}
+
+// Applies a job's settings on top of the scene's camera.
+inline bool apply_settings(camera& cam, const render_job& job) {
+    for (const auto& setting : job.settings) {
+        auto found = batch::setters().find(setting.first);
+        if (found == batch::setters().end()) {
+            std::cerr << "ERROR: Unknown camera setting: " << setting.first << std::endl;
+            return false;
+        }
+        if (!found->second(cam, setting.second)) {
+            std::cerr << "ERROR: Bad value for " << setting.first << ": " << setting.second << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+#endif
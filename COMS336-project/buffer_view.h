@@ -0,0 +1,28 @@
+#ifndef BUFFER_VIEW_H
+#define BUFFER_VIEW_H
+
+#include <cstddef>
+#include <vector>
+
+// A read-only window onto an array owned by someone else: a std::vector, or a
+// section of a memory-mapped file.
+template <typename T>
+struct buffer_view {
+    const T* data = nullptr;
+    size_t   size = 0;
+
+    buffer_view() {}
+
+    buffer_view(const T* data, size_t size) : data(data), size(size) {}
+
+    buffer_view(const std::vector<T>& v) : data(v.data()), size(v.size()) {}
+
+    const T& operator[](size_t i) const { return data[i]; }
+
+    bool empty() const { return size == 0; }
+
+    const T* begin() const { return data; }
+    const T* end() const { return data + size; }
+};
+
+#endif
@@ -2,82 +2,689 @@
 #define BVH_H
 
 #include "aabb.h"
+#include "buffer_view.h"
 #include "canbehit.h"
 #include "canbehit_list.h"
 #include "interval.h"
 
 #include <algorithm>
+#include <cstdint>
+#include <vector>
 
-class bvh_node : public canbehit {
+#if defined(__SSE2__)
+    #include <immintrin.h>
+#endif
+
+// One node of a flattened BVH, 32 bytes. Nodes are stored in depth-first order,
+// so an interior node's first child always sits right after it in the array.
+struct linear_bvh_node {
+    float    bounds_min[3];
+    float    bounds_max[3];
+    uint32_t offset;  // First primitive of a leaf, second child of an interior node
+    uint16_t count;   // Primitives in a leaf, 0 for interior nodes
+    uint8_t  axis;    // Split axis of an interior node
+    uint8_t  pad;
+};
+
+// The precomputed part of a ray that every box test shares.
+struct bvh_ray {
+    float origin[3];
+    float inv_dir[3];
+    bool  dir_is_neg[3];
+
+    bvh_ray(const ray& r) {
+        for (int axis = 0; axis < 3; axis++) {
+            origin[axis] = float(r.origin()[axis]);
+            inv_dir[axis] = float(1.0 / r.direction()[axis]);
+            dir_is_neg[axis] = inv_dir[axis] < 0;
+        }
+    }
+};
+
+// A pointer-free BVH over primitives identified by index. The binned SAH builder
+// returns the order in which primitives must be stored so that every leaf
+// covers a contiguous range of them.
+class linear_bvh {
   public:
-    bvh_node(canbehit_list list) : bvh_node(list.objects, 0, list.objects.size()) {
-        
+    // Relative costs used by the surface area heuristic.
+    static constexpr double traversal_cost = 0.125;
+    static constexpr double intersection_cost = 1.0;
+
+    static const int bin_count = 12;
+    static const int stack_size = 128;
+
+    std::vector<linear_bvh_node> nodes;
+
+    std::vector<uint32_t> build(const std::vector<aabb>& boxes, size_t max_leaf_size = 4) {
+        nodes.clear();
+        leaf_size = max_leaf_size;
+
+        std::vector<build_entry> entries;
+        entries.reserve(boxes.size());
+        for (size_t i = 0; i < boxes.size(); i++)
+            entries.push_back({boxes[i], boxes[i].centroid(), uint32_t(i)});
+
+        if (!entries.empty()) {
+            nodes.reserve(2 * entries.size());
+            build_node(entries, 0, entries.size(), 0);
+        }
+
+        std::vector<uint32_t> order;
+        order.reserve(entries.size());
+        for (const auto& entry : entries)
+            order.push_back(entry.index);
+
+        return order;
     }
 
-    bvh_node(std::vector<shared_ptr<canbehit>>& objects, size_t start, size_t end) {
-        bbox = aabb::empty;
+    bool empty() const { return nodes.empty(); }
+
+    // Expected cost of tracing a ray that hits the root box, in units of one
+    // primitive intersection. Lower is a better tree.
+    double sah_cost() const {
+        if (nodes.empty())
+            return 0;
+
+        double total = 0;
+        for (const auto& node : nodes) {
+            total += node.count > 0 ? node_area(node) * intersection_cost * node.count
+                                    : node_area(node) * traversal_cost;
+        }
+
+        auto root_area = node_area(nodes[0]);
+        return root_area > 0 ? total / root_area : 0;
+    }
+
+    // Visits the leaves along the ray front to back. intersect(index, ray_t) tests
+    // primitive index of the stored order and shrinks ray_t.max when it hits.
+    template <typename intersect_fn>
+    bool traverse(const ray& r, interval ray_t, intersect_fn&& intersect) const {
+        if (nodes.empty())
+            return false;
+
+        bvh_ray br(r);
+        bool hit_anything = false;
+
+        uint32_t stack[stack_size];
+        int stack_top = 0;
+        uint32_t current = 0;
+
+        while (true) {
+            const auto& node = nodes[current];
+
+            if (hit_box(node, br, ray_t)) {
+                if (node.count > 0) {
+                    for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+                        if (intersect(i, ray_t))
+                            hit_anything = true;
+                    }
+                } else {
+                    // Descend into the child on the ray's side of the split first.
+                    if (br.dir_is_neg[node.axis]) {
+                        stack[stack_top++] = current + 1;
+                        current = node.offset;
+                    } else {
+                        stack[stack_top++] = node.offset;
+                        current = current + 1;
+                    }
+                    continue;
+                }
+            }
+
+            if (stack_top == 0)
+                break;
+            current = stack[--stack_top];
+        }
+
+        return hit_anything;
+    }
+
+    static bool hit_box(const linear_bvh_node& node, const bvh_ray& br, const interval& ray_t) {
+        // Widen the exit distance slightly so float rounding never culls a box
+        // that the ray actually grazes.
+        const float rounding_slack = 1.0f + 2.0f * 3.6e-7f;
+
+        float t_min = float(ray_t.min);
+        float t_max = float(ray_t.max);
+
+        for (int axis = 0; axis < 3; axis++) {
+            float t0 = (node.bounds_min[axis] - br.origin[axis]) * br.inv_dir[axis];
+            float t1 = (node.bounds_max[axis] - br.origin[axis]) * br.inv_dir[axis];
+            if (br.dir_is_neg[axis])
+                std::swap(t0, t1);
+
+            t1 *= rounding_slack;
+            t_min = t0 > t_min ? t0 : t_min;
+            t_max = t1 < t_max ? t1 : t_max;
+        }
+
+        return t_min <= t_max;
+    }
 
-        for (size_t object_index=start; object_index < end; object_index++)
-            bbox = aabb(bbox, objects[object_index]->bounding_box());
+  private:
+    struct build_entry {
+        aabb box;
+        point3 centroid;
+        uint32_t index;
+    };
+
+    struct bin {
+        aabb box = aabb::empty;
+        size_t count = 0;
+    };
+
+    // Past this depth the builder switches to median splits, which keeps the
+    // tree shallow enough for the fixed traversal stack.
+    static const int max_sah_depth = 64;
+
+    size_t leaf_size = 4;
+
+    void build_node(std::vector<build_entry>& entries, size_t start, size_t end, int depth) {
+        auto bbox = aabb::empty;
+        auto centroid_box = aabb::empty;
 
-        int axis = bbox.longest_axis();
+        for (size_t i = start; i < end; i++) {
+            bbox = aabb(bbox, entries[i].box);
+            centroid_box = aabb(centroid_box, aabb(entries[i].centroid, entries[i].centroid));
+        }
 
-        auto comparator = (axis == 0) ? box_x_compare
-                        : (axis == 1) ? box_y_compare
-                                      : box_z_compare;
+        auto node_index = nodes.size();
+        nodes.push_back(make_node(bbox));
 
         size_t object_span = end - start;
+        double leaf_cost = intersection_cost * object_span;
+
+        // Find the cheapest of the bin boundaries along every axis.
+        int best_axis = -1;
+        int best_split = 0;
+        double best_cost = infinity;
+
+        for (int axis = 0; axis < 3 && object_span > 1 && depth < max_sah_depth; axis++) {
+            const auto& extent = centroid_box.axis_interval(axis);
+            if (extent.size() <= 0)
+                continue;
+
+            bin bins[bin_count];
+            for (size_t i = start; i < end; i++) {
+                auto& b = bins[bin_index(entries[i].centroid[axis], extent)];
+                b.box = aabb(b.box, entries[i].box);
+                b.count++;
+            }
+
+            // Sweep from the right to get the area and count of every right side.
+            double right_area[bin_count];
+            size_t right_count[bin_count];
+            auto right_box = aabb::empty;
+            size_t count = 0;
+            for (int i = bin_count - 1; i > 0; i--) {
+                right_box = aabb(right_box, bins[i].box);
+                count += bins[i].count;
+                right_area[i] = right_box.surface_area();
+                right_count[i] = count;
+            }
 
-        if (object_span == 1) {
-            left = right = objects[start];
-        } else if (object_span == 2) {
-            left = objects[start];
-            right = objects[start+1];
+            auto left_box = aabb::empty;
+            count = 0;
+            for (int i = 1; i < bin_count; i++) {
+                left_box = aabb(left_box, bins[i-1].box);
+                count += bins[i-1].count;
+                if (count == 0 || right_count[i] == 0)
+                    continue;
+
+                double cost = left_box.surface_area() * count + right_area[i] * right_count[i];
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_split = i;
+                }
+            }
+        }
+
+        double parent_area = bbox.surface_area();
+        if (best_axis >= 0 && parent_area > 0)
+            best_cost = traversal_cost + intersection_cost * best_cost / parent_area;
+
+        if (object_span <= leaf_size && (best_axis < 0 || leaf_cost <= best_cost)) {
+            nodes[node_index].offset = uint32_t(start);
+            nodes[node_index].count = uint16_t(object_span);
+            return;
+        }
+
+        size_t mid;
+        int axis;
+        if (best_axis >= 0) {
+            const auto& extent = centroid_box.axis_interval(best_axis);
+            auto middle = std::partition(
+                entries.begin() + start, entries.begin() + end,
+                [&](const build_entry& e) {
+                    return bin_index(e.centroid[best_axis], extent) < best_split;
+                });
+            mid = middle - entries.begin();
+            axis = best_axis;
         } else {
-            std::sort(std::begin(objects) + start, std::begin(objects) + end, comparator);
+            // No plane separates the centroids (or the tree got too deep), so
+            // split by count along the longest axis.
+            axis = centroid_box.longest_axis();
+            mid = start + object_span/2;
+            std::nth_element(
+                entries.begin() + start, entries.begin() + mid, entries.begin() + end,
+                [axis](const build_entry& a, const build_entry& b) {
+                    return a.centroid[axis] < b.centroid[axis];
+                });
+        }
+
+        build_node(entries, start, mid, depth + 1);
+        nodes[node_index].offset = uint32_t(nodes.size());
+        nodes[node_index].axis = uint8_t(axis);
+        build_node(entries, mid, end, depth + 1);
+    }
+
+    static int bin_index(double centroid, const interval& extent) {
+        int index = int(bin_count * (centroid - extent.min) / extent.size());
+        return std::clamp(index, 0, bin_count - 1);
+    }
 
-            auto mid = start + object_span/2;
-            left = make_shared<bvh_node>(objects, start, mid);
-            right = make_shared<bvh_node>(objects, mid, end);
+    // Rounds outward, so the float box always contains the double one.
+    static linear_bvh_node make_node(const aabb& box) {
+        linear_bvh_node node{};
+        for (int axis = 0; axis < 3; axis++) {
+            const auto& extent = box.axis_interval(axis);
+            float lo = float(extent.min);
+            float hi = float(extent.max);
+            if (lo > extent.min) lo = std::nextafter(lo, -INFINITY);
+            if (hi < extent.max) hi = std::nextafter(hi, INFINITY);
+            node.bounds_min[axis] = lo;
+            node.bounds_max[axis] = hi;
         }
+        return node;
     }
 
-    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-        if (!bbox.hit(r, ray_t))
-            return false;
+    static double node_area(const linear_bvh_node& node) {
+        double dx = node.bounds_max[0] - node.bounds_min[0];
+        double dy = node.bounds_max[1] - node.bounds_min[1];
+        double dz = node.bounds_max[2] - node.bounds_min[2];
+        return 2 * (dx*dy + dy*dz + dz*dx);
+    }
+};
+
+// One node of a 4- or 8-wide BVH. Child boxes are kept as structure of arrays,
+// so a single SIMD slab test checks all of them at once. Leaves are stored
+// directly in their parent's slots; unused slots hold an inverted empty box.
+template <int N>
+struct alignas(32) wide_bvh_node {
+    float    bounds_min[3][N];
+    float    bounds_max[3][N];
+    uint32_t offset[N];  // Child node, or first primitive of a leaf slot
+    uint16_t count[N];   // Primitives in a leaf slot, 0 for a child node
+};
+
+// A wide BVH made by collapsing a binary linear_bvh. It keeps the binary tree's
+// primitive order, so the same intersect callback works with both.
+template <int N>
+class wide_bvh {
+  public:
+    static_assert(N == 4 || N == 8, "wide_bvh supports 4 or 8 children per node");
+
+    static const int stack_size = 1024;
 
-        bool hit_left = left->hit(r, ray_t, rec);
-        bool hit_right = right->hit(r, interval(ray_t.min, hit_left ? rec.t : ray_t.max), rec);
+    std::vector<wide_bvh_node<N>> nodes;
 
-        return hit_left || hit_right;
+    // Small binary subtrees become single leaf slots; their primitives are
+    // contiguous because the binary tree is stored depth first.
+    void collapse(const linear_bvh& binary, size_t max_leaf_size = 4) {
+        nodes.clear();
+        external = buffer_view<wide_bvh_node<N>>();
+        if (binary.empty())
+            return;
+
+        leaf_size = max_leaf_size;
+        subtree_first.assign(binary.nodes.size(), 0);
+        subtree_count.assign(binary.nodes.size(), 0);
+        count_subtree(binary, 0);
+
+        collapse_node(binary, 0);
+
+        subtree_first = std::vector<uint32_t>();
+        subtree_count = std::vector<uint32_t>();
     }
 
-    aabb bounding_box() const override { return bbox; }
+    // Traverses nodes stored elsewhere, such as a memory-mapped cache file,
+    // instead of building them. The caller keeps the storage alive.
+    void attach(buffer_view<wide_bvh_node<N>> stored) {
+        nodes.clear();
+        external = stored;
+    }
+
+    buffer_view<wide_bvh_node<N>> node_view() const {
+        return nodes.empty() ? external : buffer_view<wide_bvh_node<N>>(nodes);
+    }
+
+    bool empty() const { return node_view().empty(); }
+
+    template <typename intersect_fn>
+    bool traverse(const ray& r, interval ray_t, intersect_fn&& intersect) const {
+        auto all_nodes = node_view();
+        if (all_nodes.empty())
+            return false;
+
+        bvh_ray br(r);
+        bool hit_anything = false;
+
+        stack_entry stack[stack_size];
+        int stack_top = 0;
+        stack[stack_top++] = {0, 0, -INFINITY};
+
+        while (stack_top > 0) {
+            auto entry = stack[--stack_top];
+
+            // Skip boxes that start beyond the closest hit found since they were pushed.
+            if (entry.t_near > float(ray_t.max))
+                continue;
+
+            if (entry.count > 0) {
+                for (uint32_t i = entry.offset; i < entry.offset + entry.count; i++) {
+                    if (intersect(i, ray_t))
+                        hit_anything = true;
+                }
+                continue;
+            }
+
+            const auto& node = all_nodes[entry.offset];
+            float t_near[N];
+            unsigned mask = hit_boxes(node, br, ray_t, t_near);
+
+            stack_entry hits[N];
+            int hit_count = 0;
+            while (mask) {
+                int i = __builtin_ctz(mask);
+                mask &= mask - 1;
+                hits[hit_count++] = {node.offset[i], node.count[i], t_near[i]};
+            }
+
+            // Push far to near, so the nearest child is popped first.
+            for (int i = 1; i < hit_count; i++) {
+                auto key = hits[i];
+                int j = i - 1;
+                for (; j >= 0 && hits[j].t_near < key.t_near; j--)
+                    hits[j+1] = hits[j];
+                hits[j+1] = key;
+            }
+
+            for (int i = 0; i < hit_count; i++)
+                stack[stack_top++] = hits[i];
+        }
+
+        return hit_anything;
+    }
 
   private:
-    shared_ptr<canbehit> left;
-    shared_ptr<canbehit> right;
-    aabb bbox;
+    struct stack_entry {
+        uint32_t offset;
+        uint16_t count;
+        float    t_near;
+    };
+
+    buffer_view<wide_bvh_node<N>> external;
+    size_t leaf_size = 4;
+    std::vector<uint32_t> subtree_first;
+    std::vector<uint32_t> subtree_count;
+
+    void count_subtree(const linear_bvh& binary, uint32_t index) {
+        const auto& node = binary.nodes[index];
+        if (node.count > 0) {
+            subtree_first[index] = node.offset;
+            subtree_count[index] = node.count;
+            return;
+        }
+
+        count_subtree(binary, index + 1);
+        count_subtree(binary, node.offset);
+        subtree_first[index] = subtree_first[index + 1];
+        subtree_count[index] = subtree_count[index + 1] + subtree_count[node.offset];
+    }
+
+    bool is_leaf_slot(const linear_bvh& binary, uint32_t index) const {
+        return binary.nodes[index].count > 0 || subtree_count[index] <= leaf_size;
+    }
 
-    static bool box_compare(
-        const shared_ptr<canbehit> a, const shared_ptr<canbehit> b, int axis_index
+    uint32_t collapse_node(const linear_bvh& binary, uint32_t binary_index) {
+        // Pull grandchildren up into this node, always opening the interior
+        // child with the largest surface area, until all N slots are used.
+        uint32_t slots[N];
+        int slot_count = 0;
+
+        const auto& root = binary.nodes[binary_index];
+        if (root.count > 0) {
+            slots[slot_count++] = binary_index;
+        } else {
+            slots[slot_count++] = binary_index + 1;
+            slots[slot_count++] = root.offset;
+        }
+
+        while (slot_count < N) {
+            int best = -1;
+            double best_area = -1;
+            for (int i = 0; i < slot_count; i++) {
+                const auto& node = binary.nodes[slots[i]];
+                if (!is_leaf_slot(binary, slots[i]) && area(node) > best_area) {
+                    best = i;
+                    best_area = area(node);
+                }
+            }
+
+            if (best < 0)
+                break;
+
+            auto opened = slots[best];
+            slots[best] = opened + 1;
+            slots[slot_count++] = binary.nodes[opened].offset;
+        }
+
+        auto wide_index = uint32_t(nodes.size());
+        nodes.emplace_back();
+
+        auto& fresh = nodes.back();
+        for (int i = 0; i < N; i++) {
+            for (int axis = 0; axis < 3; axis++) {
+                fresh.bounds_min[axis][i] = INFINITY;
+                fresh.bounds_max[axis][i] = -INFINITY;
+            }
+            fresh.offset[i] = 0;
+            fresh.count[i] = 0;
+        }
+
+        for (int i = 0; i < slot_count; i++) {
+            const auto& child = binary.nodes[slots[i]];
+            bool leaf = is_leaf_slot(binary, slots[i]);
+
+            uint32_t offset = leaf ? subtree_first[slots[i]] : collapse_node(binary, slots[i]);
+
+            // collapse_node may grow the array, so look the node up again.
+            auto& node = nodes[wide_index];
+            for (int axis = 0; axis < 3; axis++) {
+                node.bounds_min[axis][i] = child.bounds_min[axis];
+                node.bounds_max[axis][i] = child.bounds_max[axis];
+            }
+            node.offset[i] = offset;
+            node.count[i] = leaf ? uint16_t(subtree_count[slots[i]]) : 0;
+        }
+
+        return wide_index;
+    }
+
+    static double area(const linear_bvh_node& node) {
+        double dx = node.bounds_max[0] - node.bounds_min[0];
+        double dy = node.bounds_max[1] - node.bounds_min[1];
+        double dz = node.bounds_max[2] - node.bounds_min[2];
+        return dx*dy + dy*dz + dz*dx;
+    }
+
+    // Slab test against every child box. Returns a bit mask of the boxes hit and
+    // writes each box's entry distance to t_near.
+    static unsigned hit_boxes(
+        const wide_bvh_node<N>& node, const bvh_ray& br, const interval& ray_t, float* t_near
     ) {
-        auto a_axis_interval = a->bounding_box().axis_interval(axis_index);
-        auto b_axis_interval = b->bounding_box().axis_interval(axis_index);
-        return a_axis_interval.min < b_axis_interval.min;
+        const float rounding_slack = 1.0f + 2.0f * 3.6e-7f;
+
+#if defined(__AVX__)
+        if constexpr (N == 8) {
+            __m256 t_min = _mm256_set1_ps(float(ray_t.min));
+            __m256 t_max = _mm256_set1_ps(float(ray_t.max));
+            __m256 slack = _mm256_set1_ps(rounding_slack);
+
+            for (int axis = 0; axis < 3; axis++) {
+                bool neg = br.dir_is_neg[axis];
+                __m256 origin = _mm256_set1_ps(br.origin[axis]);
+                __m256 inv_dir = _mm256_set1_ps(br.inv_dir[axis]);
+                __m256 slab_lo = _mm256_load_ps(neg ? node.bounds_max[axis] : node.bounds_min[axis]);
+                __m256 slab_hi = _mm256_load_ps(neg ? node.bounds_min[axis] : node.bounds_max[axis]);
+
+                // max/min return their second operand for NaN, which ignores
+                // the 0 * inf case of an axis-parallel ray.
+                __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(slab_lo, origin), inv_dir);
+                __m256 t1 = _mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(slab_hi, origin), inv_dir), slack);
+                t_min = _mm256_max_ps(t0, t_min);
+                t_max = _mm256_min_ps(t1, t_max);
+            }
+
+            _mm256_storeu_ps(t_near, t_min);
+            return unsigned(_mm256_movemask_ps(_mm256_cmp_ps(t_min, t_max, _CMP_LE_OQ)));
+        }
+#endif
+
+#if defined(__SSE2__)
+        if constexpr (N == 4) {
+            __m128 t_min = _mm_set1_ps(float(ray_t.min));
+            __m128 t_max = _mm_set1_ps(float(ray_t.max));
+            __m128 slack = _mm_set1_ps(rounding_slack);
+
+            for (int axis = 0; axis < 3; axis++) {
+                bool neg = br.dir_is_neg[axis];
+                __m128 origin = _mm_set1_ps(br.origin[axis]);
+                __m128 inv_dir = _mm_set1_ps(br.inv_dir[axis]);
+                __m128 slab_lo = _mm_load_ps(neg ? node.bounds_max[axis] : node.bounds_min[axis]);
+                __m128 slab_hi = _mm_load_ps(neg ? node.bounds_min[axis] : node.bounds_max[axis]);
+
+                __m128 t0 = _mm_mul_ps(_mm_sub_ps(slab_lo, origin), inv_dir);
+                __m128 t1 = _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(slab_hi, origin), inv_dir), slack);
+                t_min = _mm_max_ps(t0, t_min);
+                t_max = _mm_min_ps(t1, t_max);
+            }
+
+            _mm_storeu_ps(t_near, t_min);
+            return unsigned(_mm_movemask_ps(_mm_cmple_ps(t_min, t_max)));
+        }
+#endif
+
+        unsigned mask = 0;
+        for (int i = 0; i < N; i++) {
+            float t_min = float(ray_t.min);
+            float t_max = float(ray_t.max);
+
+            for (int axis = 0; axis < 3; axis++) {
+                bool neg = br.dir_is_neg[axis];
+                float t0 = ((neg ? node.bounds_max : node.bounds_min)[axis][i] - br.origin[axis])
+                         * br.inv_dir[axis];
+                float t1 = ((neg ? node.bounds_min : node.bounds_max)[axis][i] - br.origin[axis])
+                         * br.inv_dir[axis] * rounding_slack;
+                t_min = t0 > t_min ? t0 : t_min;
+                t_max = t1 < t_max ? t1 : t_max;
+            }
+
+            t_near[i] = t_min;
+            if (t_min <= t_max)
+                mask |= 1u << i;
+        }
+        return mask;
     }
+};
+
+class bvh_node : public canbehit {
+  public:
+    // width picks the tree layout: 2 for the binary tree, or 4 / 8 to collapse
+    // it into a wide BVH that tests all children of a node with one SIMD test.
+    bvh_node(canbehit_list list, int width = 2)
+      : bvh_node(list.objects, 0, list.objects.size(), width)
+    {
 
-    static bool box_x_compare (const shared_ptr<canbehit> a, const shared_ptr<canbehit> b) {
-        return box_compare(a, b, 0);
     }
 
-    static bool box_y_compare (const shared_ptr<canbehit> a, const shared_ptr<canbehit> b) {
-        return box_compare(a, b, 1);
+    bvh_node(std::vector<shared_ptr<canbehit>>& objects, size_t start, size_t end, int width = 2)
+      : width(width)
+    {
+        // Boxes are fetched once up front, so the builder never makes virtual
+        // calls or copies shared_ptrs while partitioning.
+        std::vector<aabb> boxes;
+        boxes.reserve(end - start);
+
+        bbox = aabb::empty;
+        for (size_t object_index=start; object_index < end; object_index++) {
+            boxes.push_back(objects[object_index]->bounding_box());
+            bbox = aabb(bbox, boxes.back());
+        }
+
+        for (auto index : tree.build(boxes))
+            primitives.push_back(objects[start + index]);
+
+        cost = tree.sah_cost();
+        size_t node_count = tree.nodes.size();
+
+        // Scene primitives are expensive virtual calls, so only the binary
+        // leaves become leaf slots; merging them would add primitive tests.
+        if (width == 4) {
+            tree4.collapse(tree, 1);
+            node_count = tree4.nodes.size();
+        } else if (width == 8) {
+            tree8.collapse(tree, 1);
+            node_count = tree8.nodes.size();
+        }
+
+        if (width == 4 || width == 8)
+            tree.nodes = std::vector<linear_bvh_node>();
+
+        std::clog << "BVH" << (width == 4 || width == 8 ? width : 2) << ": " << primitives.size()
+                  << " primitives, " << node_count << " nodes, SAH cost " << cost << '\n';
     }
 
-    static bool box_z_compare (const shared_ptr<canbehit> a, const shared_ptr<canbehit> b) {
-        return box_compare(a, b, 2);
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        auto intersect = [&](uint32_t index, interval& t) {
+            if (!primitives[index]->hit(r, t, rec))
+                return false;
+
+            t.max = rec.t;
+            return true;
+        };
+
+        if (width == 4) return tree4.traverse(r, ray_t, intersect);
+        if (width == 8) return tree8.traverse(r, ray_t, intersect);
+        return tree.traverse(r, ray_t, intersect);
     }
+
+    aabb bounding_box() const override { return bbox; }
+
+    size_t object_count() const override {
+        size_t count = 0;
+        for (const auto& primitive : primitives)
+            count += primitive->object_count();
+        return count;
+    }
+
+    void gather_lights(std::vector<shared_ptr<canbehit>>& lights) const override {
+        for (const auto& primitive : primitives)
+            collect_lights(primitive, lights);
+    }
+
+    // SAH cost of the binary tree the wide layouts are collapsed from.
+    double sah_cost() const { return cost; }
+
+  private:
+    int width;
+    linear_bvh tree;
+    wide_bvh<4> tree4;
+    wide_bvh<8> tree8;
+    std::vector<shared_ptr<canbehit>> primitives;  // Stored in leaf order
+    aabb bbox;
+    double cost;
 };
 
-#endif
\ No newline at end of file
+#endif
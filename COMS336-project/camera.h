@@ -2,7 +2,17 @@
 #define CAMERA_H
 
 #include "canbehit.h"
+#include "canbehit_list.h"
+#include "denoiser.h"
+#include "image_writer.h"
 #include "material.h"
+#include "render_checkpoint.h"
+#include "thread_pool.h"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
 
 class camera {
     public: 
@@ -11,6 +21,7 @@ class camera {
         int image_width = 100;
         int samples_per_pixel = 10;
         int max_depth = 10;
+        int roulette_depth = 3;  // Bounces before Russian roulette may end a path
         color  background;
 
         double vfov = 90;
@@ -22,31 +33,154 @@ class camera {
         double defocus_angle = 0;
         double focus_dist = 10;
 
-        void render(const canbehit& world) {
+        // How the values of a pixel's samples are chosen (see sampler.h)
+        sampler_type sampling = sampler_type::sobol;
+
+        // Next-event estimation: diffuse surfaces and media also trace a ray
+        // to a point picked on one of the scene's emitters, and the two ways
+        // of finding light are combined with multiple importance sampling.
+        bool light_sampling = true;
+
+        int thread_count = 0;   // Worker threads, 0 uses every hardware thread
+        int tile_size = 16;     // Tile edge length in pixels
+
+        // The finished image is written on a background thread. An empty
+        // output_file writes to stdout.
+        image_format output_format = image_format::ppm;
+        std::string  output_file;
+
+        // Progressive rendering: samples are taken in passes of samples_per_pass
+        // over the whole image, 0 takes them all in one pass. With a checkpoint
+        // file, the sums are saved every checkpoint_interval seconds, and a
+        // stopped render resumes from them when it is run again with the same
+        // scene and settings. The file is removed once the image is written.
+        int samples_per_pass = 0;
+        std::string checkpoint_file;
+        double checkpoint_interval = 300;
+
+        // Adaptive sampling: once a pixel has adaptive_min_samples, it stops as
+        // soon as the relative standard error of its mean luminance, and of its
+        // neighbours', drops below adaptive_threshold. The samples it saves go to
+        // noisier pixels, up to max_samples_per_pixel each, while the whole
+        // image keeps to samples_per_pixel on average. A map of the samples
+        // each pixel took is written to sample_map_file if it is set.
+        bool adaptive = false;
+        double adaptive_threshold = 0.05;
+        int adaptive_min_samples = 16;
+        int max_samples_per_pixel = 0;  // 0 allows four times samples_per_pixel
+        std::string sample_map_file;
+
+        // The first hit of every sample also records the albedo, shading normal
+        // and distance of the surface it found. With denoise set, their averages
+        // guide an edge-avoiding filter over the finished image. They are
+        // written to the files below if those are set.
+        bool denoise = false;
+        std::string albedo_file;
+        std::string normal_file;
+        std::string depth_file;
+
+        // Optional pool to share between cameras. Without one, a thread_count of 0
+        // renders on the process-wide pool and any other count creates a pool.
+        shared_ptr<thread_pool> workers;
+
+        // Returns false if the render did not run because its checkpoint file
+        // holds other state.
+        bool render(const canbehit& world) {
             init();
 
-            std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
+            lights = canbehit_list();
+            if (light_sampling) {
+                std::vector<shared_ptr<canbehit>> emitters;
+                world.gather_lights(emitters);
+                for (const auto& emitter : emitters)
+                    lights.add(emitter);
+            }
 
-            for (int i = 0; i < image_height; i++) {
-                std::clog << "\rScanlines left: " << (image_height - i) << ' ' << std::flush;
-                for (int k = 0; k < image_width; k++) {
-                    color pixel_color(0, 0, 0);
+            size_t pixel_count = size_t(image_width) * image_height;
+            image_buffer sums(image_width, image_height);
+            stats.assign(2 * pixel_count, 0.0f);
+            aux_sums.assign(wants_aux() ? aux_floats * pixel_count : 0, 0.0f);
+
+            render_checkpoint checkpoint;
+            std::vector<render_checkpoint::region> state = {
+                {sums.pixels.data(), sums.pixels.size()},
+                {stats.data(), stats.size()}
+            };
+            if (wants_aux())
+                state.push_back({aux_sums.data(), aux_sums.size()});
+            if (!checkpoint_file.empty()) {
+                switch (checkpoint.open(checkpoint_file, image_width, image_height, settings_hash(world), state)) {
+                    case render_checkpoint::open_result::refused:
+                        return false;
+                    case render_checkpoint::open_result::resumed:
+                        std::clog << "Resuming " << checkpoint_file << " at "
+                                  << samples_taken() / pixel_count << " samples per pixel\n";
+                        break;
+                    case render_checkpoint::open_result::started:
+                        break;
+                }
+            }
 
-                    for(int sample = 0; sample < samples_per_pixel; sample++) {
-                        ray r = get_ray(k, i);
-                        pixel_color += ray_color(r, max_depth, world);
-                    }
+            int pass_size = samples_per_pass > 0 ? samples_per_pass
+                          : adaptive ? std::min(adaptive_min_samples, samples_per_pixel) : samples_per_pixel;
+            double budget = double(samples_per_pixel) * pixel_count;
+            auto last_save = std::chrono::steady_clock::now();
+            bool unsaved = false;
+
+            while (samples_taken() < budget) {
+                if (render_pass(world, sums, pass_size) == 0)
+                    break;
+                unsaved = true;
+
+                auto now = std::chrono::steady_clock::now();
+                if (checkpoint.valid() && std::chrono::duration<double>(now - last_save).count() >= checkpoint_interval) {
+                    checkpoint.save(state);
+                    last_save = now;
+                    unsaved = false;
+                }
+            }
+
+            if (checkpoint.valid() && unsaved)
+                checkpoint.save(state);
 
-                    write_color(std::cout, pixel_samples_scale * pixel_color);
+            std::clog << "\rRender complete, " << samples_taken() / pixel_count
+                      << " samples per pixel on average.          \n";
+
+            float max_count = 0;
+            for (size_t p = 0; p < pixel_count; p++) {
+                float count = stats[2*p];
+                float scale = count > 0 ? 1.0f / count : 0.0f;
+                for (int c = 0; c < 3; c++)
+                    sums.pixels[3*p + c] *= scale;
+                max_count = std::max(max_count, count);
+            }
+
+            if (wants_aux()) {
+                auto aux = average_aux();
+                if (denoise) {
+                    auto start = std::chrono::steady_clock::now();
+                    sums = denoiser().run(sums, aux, mean_variances(sums), worker_pool());
+                    std::clog << "Denoised in " << std::chrono::duration<double>(
+                                     std::chrono::steady_clock::now() - start).count() << " s\n";
                 }
+                write_aux(aux);
             }
-            std::clog << "\rRender complete.";
+
+            writer->write(std::move(sums), output_format, output_file);
+
+            if (!sample_map_file.empty())
+                write_sample_map(max_count);
+
+            if (checkpoint.valid()) {
+                writer->wait();
+                checkpoint.remove();
+            }
+            return true;
         }
     
     private:
 
         int image_height;
-        double pixel_samples_scale;
         point3 center;
         point3 pixel00_loc;
         vec3 pixel_du;
@@ -54,6 +188,321 @@ class camera {
         vec3 u, v, w;
         vec3 defocus_disk_u;
         vec3 defocus_disk_v;
+        shared_ptr<image_writer> writer = make_shared<image_writer>();  // Shared by copies of the camera
+        int passes = 0;
+        canbehit_list lights;  // Emitters found in the scene, for light sampling
+
+        thread_pool& worker_pool() {
+            if (thread_count > 0 && (!workers || workers->size() != thread_count))
+                workers = make_shared<thread_pool>(thread_count);
+            return workers ? *workers : thread_pool::shared();
+        }
+
+        // Samples taken and sum of squared luminance, per pixel
+        std::vector<float> stats;
+
+        // Sums of the first hits' albedo, normal and depth, per pixel
+        static const int aux_floats = 7;
+        std::vector<float> aux_sums;
+
+        // What the camera ray of a sample hit first
+        struct first_hit {
+            color albedo;
+            vec3 normal;
+            double depth = 0;
+        };
+
+        bool wants_aux() const {
+            return denoise || !albedo_file.empty() || !normal_file.empty() || !depth_file.empty();
+        }
+        std::vector<int> planned;  // Samples each pixel takes in the current pass
+
+        double samples_taken() const {
+            double total = 0;
+            for (size_t p = 0; p < stats.size(); p += 2)
+                total += stats[p];
+            return total;
+        }
+
+        static double luminance(double r, double g, double b) {
+            return 0.2126*r + 0.7152*g + 0.0722*b;
+        }
+
+        // Decides how many samples each pixel takes in the next pass. A pixel
+        // is done once it and its neighbours all look converged: a pixel whose
+        // first samples all missed a small light has no variance yet, but its
+        // neighbours usually have.
+        void plan_pass(const image_buffer& sums, int pass_size) {
+            size_t pixel_count = size_t(image_width) * image_height;
+            planned.assign(pixel_count, 0);
+
+            if (!adaptive) {
+                for (size_t p = 0; p < pixel_count; p++)
+                    planned[p] = std::max(0, std::min(pass_size, samples_per_pixel - int(stats[2*p])));
+                return;
+            }
+
+            std::vector<float> errors(pixel_count);
+            for (size_t p = 0; p < pixel_count; p++)
+                errors[p] = float(pixel_error(p, sums));
+
+            int limit = max_samples_per_pixel > 0 ? max_samples_per_pixel : 4 * samples_per_pixel;
+            for (int y = 0; y < image_height; y++) {
+                for (int x = 0; x < image_width; x++) {
+                    size_t p = size_t(y) * image_width + x;
+                    int wanted = std::min(pass_size, limit - int(stats[2*p]));
+                    if (wanted <= 0)
+                        continue;
+
+                    float error = 0;
+                    for (int j = std::max(y - 1, 0); j <= std::min(y + 1, image_height - 1); j++)
+                        for (int i = std::max(x - 1, 0); i <= std::min(x + 1, image_width - 1); i++)
+                            error = std::max(error, errors[size_t(j) * image_width + i]);
+
+                    planned[p] = error < adaptive_threshold ? 0 : wanted;
+                }
+            }
+
+            // Adaptive sampling moves samples between pixels within the
+            // budget, so a pass that wants more than is left is scaled down
+            // to fit, and the samples lost to rounding go to the first pixels
+            // that wanted them.
+            double remaining = double(samples_per_pixel) * pixel_count - samples_taken();
+            double total = 0;
+            for (int count : planned)
+                total += count;
+            if (total <= remaining)
+                return;
+
+            double scale = std::max(remaining, 0.0) / total;
+            std::vector<int> wanted = planned;
+            double left = std::max(remaining, 0.0);
+            for (size_t p = 0; p < pixel_count; p++) {
+                planned[p] = int(wanted[p] * scale);
+                left -= planned[p];
+            }
+            for (size_t p = 0; p < pixel_count && left >= 1; p++) {
+                if (planned[p] < wanted[p]) {
+                    planned[p]++;
+                    left--;
+                }
+            }
+        }
+
+        // Relative standard error of a pixel's mean luminance, or infinity
+        // while it has too few samples to tell.
+        double pixel_error(size_t pixel, const image_buffer& sums) const {
+            int count = int(stats[2*pixel]);
+            if (count < std::max(adaptive_min_samples, 2))
+                return infinity;
+
+            const float* sum = &sums.pixels[3*pixel];
+            double mean = luminance(sum[0], sum[1], sum[2]) / count;
+            double variance = std::max(0.0, (stats[2*pixel + 1] / count - mean*mean) * count / (count - 1));
+            return std::sqrt(variance / count) / std::max(mean, 1e-2);
+        }
+
+        // Adds one pass of samples to the pixels that still want them and
+        // returns how many samples were taken.
+        uint64_t render_pass(const canbehit& world, image_buffer& sums, int pass_size) {
+            int tiles_x = (image_width + tile_size - 1) / tile_size;
+            int tiles_y = (image_height + tile_size - 1) / tile_size;
+            int tile_count = tiles_x * tiles_y;
+
+            std::atomic<int> tiles_done{0};
+            std::atomic<uint64_t> samples{0};
+            std::mutex progress_mutex;
+            int pass = ++passes;
+            plan_pass(sums, pass_size);
+
+            worker_pool().parallel_for(tile_count, [&](int tile) {
+                int x0 = (tile % tiles_x) * tile_size;
+                int y0 = (tile / tiles_x) * tile_size;
+                samples += render_tile(world, x0, y0, sums);
+
+                int done = ++tiles_done;
+                std::unique_lock<std::mutex> lock(progress_mutex, std::try_to_lock);
+                if (lock.owns_lock()) {
+                    std::clog << "\rPass " << pass << ", tiles left: " << (tile_count - done)
+                              << ' ' << std::flush;
+                }
+            });
+
+            return samples;
+        }
+
+        uint64_t render_tile(const canbehit& world, int x0, int y0, image_buffer& sums) {
+            int x1 = std::min(x0 + tile_size, image_width);
+            int y1 = std::min(y0 + tile_size, image_height);
+            uint64_t taken = 0;
+
+            auto pixel_sampler = make_sampler(sampling, samples_per_pixel);
+            sampler::scope use_sampler(*pixel_sampler);
+
+            for (int i = y0; i < y1; i++) {
+                for (int k = x0; k < x1; k++) {
+                    auto pixel_index = uint64_t(i) * image_width + k;
+                    int count = planned[pixel_index];
+                    if (count == 0)
+                        continue;
+
+                    int first_sample = int(stats[2*pixel_index]);
+                    color pixel_color(0, 0, 0);
+                    double luminance_squares = 0;
+                    first_hit aux_sum;
+                    bool with_aux = !aux_sums.empty();
+
+                    for (int sample = first_sample; sample < first_sample + count; sample++) {
+                        pixel_sampler->start_pixel_sample(k, i, pixel_index, uint32_t(sample));
+                        auto r = get_ray(k, i);
+                        first_hit aux;
+                        color sample_color = ray_color(r, world, with_aux ? &aux : nullptr);
+                        pixel_color += sample_color;
+
+                        double y = luminance(sample_color.x(), sample_color.y(), sample_color.z());
+                        luminance_squares += y*y;
+
+                        aux_sum.albedo += aux.albedo;
+                        aux_sum.normal += aux.normal;
+                        aux_sum.depth += aux.depth;
+                    }
+
+                    if (with_aux) {
+                        float* a = &aux_sums[aux_floats * pixel_index];
+                        for (int c = 0; c < 3; c++) {
+                            a[c] += float(aux_sum.albedo[c]);
+                            a[3 + c] += float(aux_sum.normal[c]);
+                        }
+                        a[6] += float(aux_sum.depth);
+                    }
+
+                    float* pixel = sums.at(k, i);
+                    for (int c = 0; c < 3; c++)
+                        pixel[c] += float(pixel_color[c]);
+                    stats[2*pixel_index] += float(count);
+                    stats[2*pixel_index + 1] += float(luminance_squares);
+                    taken += count;
+                }
+            }
+
+            return taken;
+        }
+
+        aux_buffers average_aux() const {
+            aux_buffers aux;
+            aux.albedo = image_buffer(image_width, image_height);
+            aux.normal = image_buffer(image_width, image_height);
+            aux.depth.assign(size_t(image_width) * image_height, 0.0f);
+
+            for (size_t p = 0; p < aux.depth.size(); p++) {
+                float count = stats[2*p];
+                float scale = count > 0 ? 1.0f / count : 0.0f;
+                const float* a = &aux_sums[aux_floats * p];
+                for (int c = 0; c < 3; c++) {
+                    aux.albedo.pixels[3*p + c] = a[c] * scale;
+                    aux.normal.pixels[3*p + c] = a[3 + c] * scale;
+                }
+                aux.depth[p] = a[6] * scale;
+            }
+            return aux;
+        }
+
+        // The variance of each pixel's mean luminance, from its samples.
+        std::vector<float> mean_variances(const image_buffer& means) const {
+            std::vector<float> variances(stats.size() / 2);
+            for (size_t p = 0; p < variances.size(); p++) {
+                double n = stats[2*p];
+                const float* c = &means.pixels[3*p];
+                double mean = luminance(c[0], c[1], c[2]);
+                variances[p] = n > 1 ? float(std::max(0.0, stats[2*p + 1] / n - mean*mean) / (n - 1))
+                                     : float(mean*mean);
+            }
+            return variances;
+        }
+
+        // Normals are mapped from [-1, 1] to [0, 1] and depths scaled to the
+        // farthest hit, except in PFM files, which keep the raw values.
+        void write_aux(const aux_buffers& aux) {
+            if (!albedo_file.empty())
+                writer->write(aux.albedo, image_writer::format_for(albedo_file), albedo_file);
+
+            if (!normal_file.empty()) {
+                auto format = image_writer::format_for(normal_file);
+                image_buffer normals = aux.normal;
+                if (format != image_format::pfm) {
+                    for (auto& value : normals.pixels)
+                        value = 0.5f * value + 0.5f;
+                }
+                writer->write(std::move(normals), format, normal_file);
+            }
+
+            if (!depth_file.empty()) {
+                auto format = image_writer::format_for(depth_file);
+                float max_depth = *std::max_element(aux.depth.begin(), aux.depth.end());
+                float scale = format == image_format::pfm || max_depth == 0 ? 1.0f : 1.0f / max_depth;
+
+                image_buffer depths(image_width, image_height);
+                for (size_t p = 0; p < aux.depth.size(); p++) {
+                    for (int c = 0; c < 3; c++)
+                        depths.pixels[3*p + c] = aux.depth[p] * scale;
+                }
+                writer->write(std::move(depths), format, depth_file);
+            }
+        }
+
+        // Brighter pixels took more samples. A PFM map holds the raw counts.
+        void write_sample_map(float max_count) {
+            auto format = image_writer::format_for(sample_map_file);
+            float scale = format == image_format::pfm || max_count == 0 ? 1.0f : 1.0f / max_count;
+
+            image_buffer map(image_width, image_height);
+            for (size_t p = 0; p < stats.size() / 2; p++) {
+                for (int c = 0; c < 3; c++)
+                    map.pixels[3*p + c] = stats[2*p] * scale;
+            }
+
+            writer->write(std::move(map), format, sample_map_file);
+        }
+
+        // Identifies the render a checkpoint belongs to: every setting that
+        // changes the image, and a fingerprint of the scene made of its
+        // primitive count and the bounds of the world and of each emitter.
+        // Editing a material alone goes unnoticed.
+        uint64_t settings_hash(const canbehit& world) const {
+            std::vector<double> values = {
+                double(image_width), double(image_height), double(samples_per_pixel),
+                double(max_depth), double(roulette_depth), vfov,
+                lookfrom.x(), lookfrom.y(), lookfrom.z(), lookat.x(), lookat.y(), lookat.z(),
+                vup.x(), vup.y(), vup.z(), defocus_angle, focus_dist,
+                background.x(), background.y(), background.z(),
+                double(sampling), double(light_sampling), double(adaptive)
+            };
+
+            // Pass sizes only change which pixels the adaptive planner stops.
+            if (adaptive) {
+                values.insert(values.end(), {
+                    adaptive_threshold, double(adaptive_min_samples),
+                    double(max_samples_per_pixel), double(samples_per_pass)
+                });
+            }
+
+            std::vector<shared_ptr<canbehit>> emitters;
+            world.gather_lights(emitters);
+            values.push_back(double(world.object_count()));
+            values.push_back(double(emitters.size()));
+
+            auto add_bounds = [&](const aabb& box) {
+                for (int axis = 0; axis < 3; axis++) {
+                    values.push_back(box.axis_interval(axis).min);
+                    values.push_back(box.axis_interval(axis).max);
+                }
+            };
+            add_bounds(world.bounding_box());
+            for (const auto& emitter : emitters)
+                add_bounds(emitter->bounding_box());
+
+            return hash_values(0, values.data(), values.size());
+        }
 
         void init() {
 
@@ -61,8 +510,6 @@ class camera {
 
             image_height = (image_height < 1) ? 1 : image_height;
 
-            pixel_samples_scale = 1.0 / samples_per_pixel;
-
             center = lookfrom;
 
             auto theta = degrees_to_radians(vfov);
@@ -91,7 +538,9 @@ class camera {
 
         }
 
-        ray get_ray(int k, int i) {
+        // The ray also carries its neighbours one pixel over, through the same
+        // lens point, pulled in to the share of the pixel one sample covers.
+        ray_differential get_ray(int k, int i) const {
             auto offset = sample_square();
 
             auto pixel_sample = pixel00_loc + ((k + offset.x()) * pixel_du) + ((i + offset.y()) * pixel_dv);
@@ -99,13 +548,20 @@ class camera {
             auto ray_origin = (defocus_angle <= 0) ? center : defocus_disk_sample();;
             auto ray_dir = pixel_sample - ray_origin;
 
-            auto ray_time = random_double();
+            auto ray_time = sample_1d();
 
-            return ray(ray_origin, ray_dir, ray_time);
+            ray_differential r(ray(ray_origin, ray_dir, ray_time));
+            r.has_differentials = true;
+            r.rx_origin = r.ry_origin = ray_origin;
+            r.rx_direction = ray_dir + pixel_du;
+            r.ry_direction = ray_dir + pixel_dv;
+            r.scale_differentials(std::fmax(0.125, 1 / std::sqrt(double(std::max(samples_per_pixel, 1)))));
+            return r;
         }
 
         vec3 sample_square() const {
-            return vec3(random_double() - 0.5, random_double() - 0.5, 0);
+            auto s = sample_2d();
+            return vec3(s.u - 0.5, s.v - 0.5, 0);
         }
 
         point3 defocus_disk_sample() const {
@@ -113,27 +569,94 @@ class camera {
             return center + (p[0] * defocus_disk_u) + (p[1] * defocus_disk_v);
         }
 
-        color ray_color(const ray& r, int depth, const canbehit& world) const {
+        // Follows one path for up to max_depth rays, and records its first hit
+        // in aux if given. scatter_pdf is the density
+        // with which the last bounce picked r, or 0 for the camera ray and
+        // after specular bounces. Light that r finds is then weighed against
+        // the chance of light sampling finding it too.
+        color ray_color(const ray_differential& camera_ray, const canbehit& world, first_hit* aux = nullptr) const {
+            color radiance(0, 0, 0);
+            color throughput(1, 1, 1);
+            ray r = camera_ray;
+            double scatter_pdf = 0;
+
+            for (int bounce = 0; bounce < max_depth; bounce++) {
+                start_path_vertex(bounce + 1);
+
+                // Russian roulette: a path that carries little light is ended
+                // with a matching probability, and survivors carry more.
+                if (bounce >= roulette_depth) {
+                    double survive = std::fmin(1.0, std::fmax(throughput.x(), std::fmax(throughput.y(), throughput.z())));
+                    if (sample_1d() >= survive)
+                        break;
+                    throughput /= survive;
+                }
 
-            if (depth <= 0)
-                return color(0, 0, 0);
+                hit_record rec;
+                if (!world.hit(r, interval(0.001, infinity), rec)) {
+                    radiance += throughput * background;
+                    break;
+                }
+
+                resolve_interaction(r, rec);
+                if (bounce == 0)
+                    rec.set_footprint(camera_ray);
+
+                if (aux && bounce == 0) {
+                    aux->albedo = rec.mat->base_color(rec);
+                    aux->normal = rec.normal;
+                    aux->depth = rec.t * r.direction().length();
+                }
 
-            hit_record rec;
+                color emission = rec.mat->emitted(rec.u, rec.v, rec.p);
+                if (scatter_pdf > 0 && rec.mat->is_emissive()) {
+                    double light_pdf = lights.pdf_value(r.origin(), r.direction(), r.time());
+                    emission = power_heuristic(scatter_pdf, light_pdf) * emission;
+                }
+                radiance += throughput * emission;
+
+                bsdf_sample bs;
+                if (!rec.mat->sample(r, rec, bs))
+                    break;
 
-            if (!world.hit(r, interval(0.001, infinity), rec))
-                return background;
+                if (!bs.specular && !lights.objects.empty())
+                    radiance += throughput * sample_lights(r, rec, world);
 
-            ray scattered;
-            color attenuation;
-            color color_from_emission = rec.mat->emitted(rec.u, rec.v, rec.p);
+                throughput = throughput * bs.f / bs.pdf;
+                scatter_pdf = bs.specular ? 0 : bs.pdf;
+                r = ray(rec.p, bs.direction, r.time());
+            }
 
-            if (!rec.mat->scatter(r, rec, attenuation, scattered))
-                return color_from_emission;
+            return radiance;
+        }
 
-            color color_from_scatter = attenuation * ray_color(scattered, depth-1, world);
+        // Light arriving at rec along a direction picked on an emitter.
+        color sample_lights(const ray& r, const hit_record& rec, const canbehit& world) const {
+            ray to_light(rec.p, lights.random(rec.p, r.time()), r.time());
 
-            return color_from_emission + color_from_scatter;
+            double light_pdf = lights.pdf_value(to_light.origin(), to_light.direction(), r.time());
+            if (light_pdf <= 0)
+                return color(0, 0, 0);
+
+            color f = rec.mat->eval(r, rec, to_light.direction());
+            if (f.near_zero())
+                return color(0, 0, 0);
+
+            hit_record light_rec;
+            if (!world.hit(to_light, interval(0.001, infinity), light_rec))
+                return color(0, 0, 0);
+
+            resolve_interaction(to_light, light_rec);
+            if (!light_rec.mat->is_emissive())
+                return color(0, 0, 0);
+
+            color emitted = light_rec.mat->emitted(light_rec.u, light_rec.v, light_rec.p);
+            double weight = power_heuristic(light_pdf, rec.mat->pdf(r, rec, to_light.direction()));
+            return (weight / light_pdf) * f * emitted;
+        }
 
+        static double power_heuristic(double pdf, double other_pdf) {
+            return pdf*pdf / (pdf*pdf + other_pdf*other_pdf);
         }
 };
 
@@ -4,22 +4,96 @@
 #include "commons.h"
 #include "aabb.h"
 
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
 class material;
+class canbehit;
 
+// hit() only records what is needed to find the closest hit: its distance, the
+// object and primitive, and the barycentric or surface coordinates in u, v.
+// resolve_interaction() fills in the point, normal and material once, for the
+// hit that was kept.
 class hit_record {
     public:
+        static const int max_transforms = 8;
+
         point3 p;
         vec3 normal;
-        shared_ptr<material> mat;
+        const material* mat = nullptr;  // Owned by the object that was hit
         double t;
         double u;
         double v;
         bool front_face;
 
+        // Change of the point with u and v, for texture filtering. Left at zero
+        // by objects that have no surface parametrization.
+        vec3 dpdu;
+        vec3 dpdv;
+        uv_footprint footprint;
+
+        const canbehit* object = nullptr;
+        uint32_t primitive = 0;
+
+        // Transforms between the world and the object, innermost first.
+        const canbehit* transforms[max_transforms];
+        int transform_count = 0;
+
+        void set_hit(double hit_t, const canbehit* hit_object, uint32_t hit_primitive = 0) {
+            t = hit_t;
+            object = hit_object;
+            primitive = hit_primitive;
+            transform_count = 0;
+        }
+
+        // Dropping a transform would shade the hit in the wrong space, so
+        // nesting deeper than max_transforms stops the render.
+        void push_transform(const canbehit* transform) {
+            if (transform_count == max_transforms) {
+                std::cerr << "ERROR: More than " << max_transforms
+                          << " nested transforms; raise hit_record::max_transforms." << std::endl;
+                std::abort();
+            }
+            transforms[transform_count++] = transform;
+        }
+
         void set_face_normal(const ray& r, const vec3& outward_normal) {
             front_face = dot(r.direction(), outward_normal) < 0;
             normal = front_face ? outward_normal : -outward_normal;
         }
+
+        // Finds the footprint of a pixel in texture space from where the
+        // neighbouring rays of r meet the tangent plane at p (Igehy, "Tracing
+        // Ray Differentials").
+        void set_footprint(const ray_differential& r) {
+            footprint = uv_footprint();
+            if (!r.has_differentials)
+                return;
+
+            double d = dot(normal, p);
+            double tx = (d - dot(normal, r.rx_origin)) / dot(normal, r.rx_direction);
+            double ty = (d - dot(normal, r.ry_origin)) / dot(normal, r.ry_direction);
+            if (!std::isfinite(tx) || !std::isfinite(ty))
+                return;
+
+            vec3 dpdx = r.rx_origin + tx * r.rx_direction - p;
+            vec3 dpdy = r.ry_origin + ty * r.ry_direction - p;
+
+            // Least-squares solution of dpdx = dudx * dpdu + dvdx * dpdv
+            double a00 = dot(dpdu, dpdu), a01 = dot(dpdu, dpdv), a11 = dot(dpdv, dpdv);
+            double det = a00*a11 - a01*a01;
+            if (!(std::fabs(det) > 1e-20))
+                return;
+
+            double inv_det = 1 / det;
+            double bx0 = dot(dpdu, dpdx), bx1 = dot(dpdv, dpdx);
+            double by0 = dot(dpdu, dpdy), by1 = dot(dpdv, dpdy);
+            footprint.dudx = (a11*bx0 - a01*bx1) * inv_det;
+            footprint.dvdx = (a00*bx1 - a01*bx0) * inv_det;
+            footprint.dudy = (a11*by0 - a01*by1) * inv_det;
+            footprint.dvdy = (a00*by1 - a01*by0) * inv_det;
+        }
 };
 
 class canbehit {
@@ -28,9 +102,55 @@ class canbehit {
 
         virtual bool hit(const ray& r, interval ray_t, hit_record& rec) const = 0;
 
+        // Fills in p, normal, front_face, mat and u, v for a hit this object
+        // recorded, with r in the object's own space.
+        virtual void compute_interaction(const ray& r, hit_record& rec) const {}
+
+        // Used by transforms to move a ray into their child's space, and the
+        // finished interaction back out of it.
+        virtual ray to_object_space(const ray& r) const { return r; }
+        virtual void to_world_space(hit_record& rec) const {}
+
         virtual aabb bounding_box() const = 0;
+
+        // Primitives this object is made of. Render checkpoints use it, with
+        // the bounds, to tell a changed scene from the one they were saved for.
+        virtual size_t object_count() const { return 1; }
+
+        // Light sampling. An emitter picks directions from origin towards
+        // itself with random(), and pdf_value() gives the solid-angle density
+        // of picking a direction that way, 0 if it misses.
+        virtual bool is_emitter() const { return false; }
+
+        virtual double pdf_value(const point3& origin, const vec3& direction, double time) const {
+            return 0.0;
+        }
+
+        virtual vec3 random(const point3& origin, double time) const { return vec3(1, 0, 0); }
+
+        // Adds the emitters among this object's children to lights.
+        virtual void gather_lights(std::vector<shared_ptr<canbehit>>& lights) const {}
 };
 
+// Adds object to lights if it is an emitter, or else the emitters inside it.
+inline void collect_lights(const shared_ptr<canbehit>& object, std::vector<shared_ptr<canbehit>>& lights) {
+    if (object->is_emitter())
+        lights.push_back(object);
+    else
+        object->gather_lights(lights);
+}
+
+inline void resolve_interaction(const ray& r, hit_record& rec) {
+    ray local = r;
+    for (int i = rec.transform_count - 1; i >= 0; i--)
+        local = rec.transforms[i]->to_object_space(local);
+
+    rec.object->compute_interaction(local, rec);
+
+    for (int i = 0; i < rec.transform_count; i++)
+        rec.transforms[i]->to_world_space(rec);
+}
+
 class translate : public canbehit {
   public:
 
@@ -41,18 +161,37 @@ class translate : public canbehit {
     }
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-        ray offset_r(r.origin() - offset, r.direction(), r.time());
-
-        if (!object->hit(offset_r, ray_t, rec))
+        if (!object->hit(to_object_space(r), ray_t, rec))
             return false;
 
-        rec.p += offset;
-
+        rec.push_transform(this);
         return true;
     }
 
+    ray to_object_space(const ray& r) const override {
+        return ray(r.origin() - offset, r.direction(), r.time());
+    }
+
+    void to_world_space(hit_record& rec) const override {
+        rec.p += offset;
+    }
+
     aabb bounding_box() const override { return bbox; }
 
+    size_t object_count() const override { return object->object_count(); }
+
+    // A moved emitter is sampled as a whole; emitters that are only part of
+    // the object are left to be found by scattered rays.
+    bool is_emitter() const override { return object->is_emitter(); }
+
+    double pdf_value(const point3& origin, const vec3& direction, double time) const override {
+        return object->pdf_value(origin - offset, direction, time);
+    }
+
+    vec3 random(const point3& origin, double time) const override {
+        return object->random(origin - offset, time);
+    }
+
   private:
     shared_ptr<canbehit> object;
     vec3 offset;
@@ -95,7 +234,14 @@ class rotate_y : public canbehit {
     }
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        if (!object->hit(to_object_space(r), ray_t, rec))
+            return false;
 
+        rec.push_transform(this);
+        return true;
+    }
+
+    ray to_object_space(const ray& r) const override {
         auto origin = point3(
             (cos_theta * r.origin().x()) - (sin_theta * r.origin().z()),
             r.origin().y(),
@@ -108,11 +254,10 @@ class rotate_y : public canbehit {
             (sin_theta * r.direction().x()) + (cos_theta * r.direction().z())
         );
 
-        ray rotated_r(origin, direction, r.time());
-
-        if (!object->hit(rotated_r, ray_t, rec))
-            return false;
+        return ray(origin, direction, r.time());
+    }
 
+    void to_world_space(hit_record& rec) const override {
         rec.p = point3(
             (cos_theta * rec.p.x()) + (sin_theta * rec.p.z()),
             rec.p.y(),
@@ -125,11 +270,36 @@ class rotate_y : public canbehit {
             (-sin_theta * rec.normal.x()) + (cos_theta * rec.normal.z())
         );
 
-        return true;
+        rec.dpdu = vec3(
+            (cos_theta * rec.dpdu.x()) + (sin_theta * rec.dpdu.z()),
+            rec.dpdu.y(),
+            (-sin_theta * rec.dpdu.x()) + (cos_theta * rec.dpdu.z())
+        );
+
+        rec.dpdv = vec3(
+            (cos_theta * rec.dpdv.x()) + (sin_theta * rec.dpdv.z()),
+            rec.dpdv.y(),
+            (-sin_theta * rec.dpdv.x()) + (cos_theta * rec.dpdv.z())
+        );
     }
 
     aabb bounding_box() const override { return bbox; }
 
+    size_t object_count() const override { return object->object_count(); }
+
+    bool is_emitter() const override { return object->is_emitter(); }
+
+    double pdf_value(const point3& origin, const vec3& direction, double time) const override {
+        auto local = to_object_space(ray(origin, direction, time));
+        return object->pdf_value(local.origin(), local.direction(), time);
+    }
+
+    vec3 random(const point3& origin, double time) const override {
+        auto local = to_object_space(ray(origin, vec3(0, 0, 0), time));
+        auto d = object->random(local.origin(), time);
+        return vec3((cos_theta * d.x()) + (sin_theta * d.z()), d.y(), (-sin_theta * d.x()) + (cos_theta * d.z()));
+    }
+
   private:
     shared_ptr<canbehit> object;
     double sin_theta;
@@ -137,4 +307,34 @@ class rotate_y : public canbehit {
     aabb bbox;
 };
 
+
+// Shows a shared object with a different material: the object finds the hit, and
+// the finished interaction takes this material instead of the object's own.
+// Lets scenes that paint the same loaded mesh differently share its geometry.
+class with_material : public canbehit {
+  public:
+    with_material(shared_ptr<canbehit> object, shared_ptr<material> mat)
+      : object(object), mat(mat) {}
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        if (!object->hit(r, ray_t, rec))
+            return false;
+
+        rec.push_transform(this);
+        return true;
+    }
+
+    void to_world_space(hit_record& rec) const override {
+        rec.mat = mat.get();
+    }
+
+    aabb bounding_box() const override { return object->bounding_box(); }
+
+    size_t object_count() const override { return object->object_count(); }
+
+  private:
+    shared_ptr<canbehit> object;
+    shared_ptr<material> mat;
+};
+
 #endif
\ No newline at end of file
@@ -5,6 +5,7 @@
 #include "canbehit.h"
 #include "commons.h"
 
+#include <algorithm>
 #include <vector>
 
 class canbehit_list : public canbehit {
@@ -39,6 +40,47 @@ class canbehit_list : public canbehit {
 
     aabb bounding_box() const override { return bbox; }
 
+    size_t object_count() const override {
+        size_t count = 0;
+        for (const auto& object : objects)
+            count += object->object_count();
+        return count;
+    }
+
+    // A list made only of emitters, such as a box light, is sampled as one
+    // light that picks a part at random.
+    bool is_emitter() const override {
+        if (objects.empty())
+            return false;
+
+        for (const auto& object : objects) {
+            if (!object->is_emitter())
+                return false;
+        }
+        return true;
+    }
+
+    double pdf_value(const point3& origin, const vec3& direction, double time) const override {
+        auto weight = 1.0 / objects.size();
+        auto sum = 0.0;
+
+        for (const auto& object : objects)
+            sum += weight * object->pdf_value(origin, direction, time);
+
+        return sum;
+    }
+
+    vec3 random(const point3& origin, double time) const override {
+        auto size = int(objects.size());
+        auto index = std::min(int(sample_1d() * size), size - 1);
+        return objects[index]->random(origin, time);
+    }
+
+    void gather_lights(std::vector<shared_ptr<canbehit>>& lights) const override {
+        for (const auto& object : objects)
+            collect_lights(object, lights);
+    }
+
   private:
     aabb bbox;
 };
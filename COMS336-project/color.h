@@ -14,20 +14,16 @@ inline double lin_to_gam(double linear_component) {
     return 0;
 }
 
-void write_color(std::ostream& out, const color& pixel_color) {
-    auto r = pixel_color.x();
-    auto g = pixel_color.y();
-    auto b = pixel_color.z();
-
-    r = lin_to_gam(r);
-    g = lin_to_gam(g);
-    b = lin_to_gam(b);
-
+// Gamma-encodes a linear component and maps it to 0..255.
+inline int color_byte(double linear_component) {
     static const interval intensity(0.000, 0.999);
+    return int(256 * intensity.clamp(lin_to_gam(linear_component)));
+}
 
-    int rbyte = int(256 * intensity.clamp(r));
-    int gbyte = int(256 * intensity.clamp(g));
-    int bbyte = int(256 * intensity.clamp(b));
+void write_color(std::ostream& out, const color& pixel_color) {
+    int rbyte = color_byte(pixel_color.x());
+    int gbyte = color_byte(pixel_color.y());
+    int bbyte = color_byte(pixel_color.z());
 
     out << rbyte << ' ' << gbyte << ' ' << bbyte << '\n';
 }
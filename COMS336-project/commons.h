@@ -3,10 +3,14 @@
 
 #include <cstdlib>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <limits>
 #include <memory>
 
+#include "scene_arena.h"
+
 using std::make_shared;
 using std::shared_ptr;
 
@@ -17,8 +21,46 @@ inline double degrees_to_radians(double degrees) {
     return degrees * pi / 180.0;
 }
 
+// Counter-based random numbers (SplitMix64). Each value is a hash of a stream
+// key and the index of the draw, so there is no shared state between threads and
+// a pixel sample sees the same numbers no matter which thread renders it.
+struct random_stream {
+    uint64_t key = 0;
+    uint64_t dimension = 0;
+};
+
+inline random_stream& thread_random_stream() {
+    thread_local random_stream stream;
+    return stream;
+}
+
+inline uint64_t mix_bits(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// Folds the bits of each value into hash, for keys made of doubles.
+inline uint64_t hash_values(uint64_t hash, const double* values, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        uint64_t bits;
+        std::memcpy(&bits, &values[i], sizeof(bits));
+        hash = mix_bits(hash ^ (bits + 0x9e3779b97f4a7c15ULL));
+    }
+    return hash;
+}
+
+// Restarts the calling thread's stream for one sample of one pixel.
+inline void seed_random(uint64_t pixel, uint64_t sample) {
+    auto& stream = thread_random_stream();
+    stream.key = mix_bits(pixel * 0x9e3779b97f4a7c15ULL + mix_bits(sample + 1));
+    stream.dimension = 0;
+}
+
 inline double random_double() {
-    return std::rand() / (RAND_MAX + 1.0);
+    auto& stream = thread_random_stream();
+    auto bits = mix_bits(stream.key + (++stream.dimension) * 0x9e3779b97f4a7c15ULL);
+    return (bits >> 11) * 0x1.0p-53;
 }
 
 inline double random_double(double min, double max) {
@@ -9,12 +9,12 @@ class constant_medium : public canbehit {
   public:
     constant_medium(shared_ptr<canbehit> boundary, double density, shared_ptr<texture> tex)
       : boundary(boundary), neg_inv_density(-1/density),
-        phase_function(make_shared<isotropic>(tex))
+        phase_function(make_scene_object<isotropic>(tex)), seed(make_seed())
     {}
 
     constant_medium(shared_ptr<canbehit> boundary, double density, const color& albedo)
       : boundary(boundary), neg_inv_density(-1/density),
-        phase_function(make_shared<isotropic>(albedo))
+        phase_function(make_scene_object<isotropic>(albedo)), seed(make_seed())
     {}
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
@@ -37,19 +37,21 @@ class constant_medium : public canbehit {
 
         auto ray_length = r.direction().length();
         auto distance_inside_boundary = (rec2.t - rec1.t) * ray_length;
-        auto hit_distance = neg_inv_density * std::log(random_double());
+        auto hit_distance = neg_inv_density * std::log(1 - free_flight_random(r));
 
         if (hit_distance > distance_inside_boundary)
             return false;
 
-        rec.t = rec1.t + hit_distance / ray_length;
+        rec.set_hit(rec1.t + hit_distance / ray_length, this);
+        return true;
+    }
+
+    void compute_interaction(const ray& r, hit_record& rec) const override {
         rec.p = r.at(rec.t);
 
         rec.normal = vec3(1,0,0);
         rec.front_face = true;
-        rec.mat = phase_function;
-
-        return true;
+        rec.mat = phase_function.get();
     }
 
     aabb bounding_box() const override { return boundary->bounding_box(); }
@@ -58,6 +60,27 @@ class constant_medium : public canbehit {
     shared_ptr<canbehit> boundary;
     double neg_inv_density;
     shared_ptr<material> phase_function;
+    uint64_t seed;
+
+    uint64_t make_seed() const {
+        auto box = boundary->bounding_box();
+        const double values[] = {
+            box.x.min, box.x.max, box.y.min, box.y.max, box.z.min, box.z.max, neg_inv_density
+        };
+        return hash_values(0, values, sizeof(values) / sizeof(values[0]));
+    }
+
+    // hit() runs for shadow rays too, in an order set by the hierarchy, so a
+    // sampler draw here would take the dimensions the path expects next. The
+    // free-flight distance is a hash of the ray and the medium instead, which
+    // also gives every traversal of the same ray the same answer.
+    double free_flight_random(const ray& r) const {
+        const double values[] = {
+            r.origin().x(), r.origin().y(), r.origin().z(),
+            r.direction().x(), r.direction().y(), r.direction().z(), r.time()
+        };
+        return (hash_values(seed, values, sizeof(values) / sizeof(values[0])) >> 11) * 0x1.0p-53;
+    }
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,190 @@
+#ifndef DENOISER_H
+#define DENOISER_H
+
+#include "image_writer.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// Per-pixel averages of what the first hit of each sample found. They guide the
+// denoiser and can be written out for other tools.
+struct aux_buffers {
+    image_buffer albedo;
+    image_buffer normal;        // Shading normal, facing the camera
+    std::vector<float> depth;   // Distance to the first hit, 0 where rays missed
+};
+
+// An edge-avoiding a-trous wavelet filter (Dammertz et al., 2010). Each pass
+// blurs with a 5x5 B3-spline kernel whose taps are spread 2^i pixels apart, and
+// every tap is weighted down where the normal or depth differs from the center
+// pixel, or where the luminance differs by more than the pixel's noise
+// explains. The noise comes from the per-pixel variance of the render and is
+// filtered along with the image, as in SVGF (Schied et al., 2017).
+//
+// The image is divided by the albedo before filtering and multiplied back
+// after, so texture detail is not blurred with the lighting.
+class denoiser {
+  public:
+    int iterations = 5;
+    float sigma_luminance = 4.0f;
+    float sigma_normal = 128.0f;
+    float sigma_depth = 1.0f;
+
+    // variance holds the variance of each pixel's mean luminance.
+    image_buffer run(const image_buffer& image, const aux_buffers& aux,
+                     const std::vector<float>& variance, thread_pool& pool) const {
+        int width = image.width, height = image.height;
+        size_t count = size_t(width) * height;
+
+        planes current(count), next(count);
+        std::vector<float> factor(3 * count);
+
+        for (size_t p = 0; p < count; p++) {
+            for (int c = 0; c < 3; c++) {
+                float a = aux.albedo.pixels[3*p + c];
+                factor[3*p + c] = a > 0.01f ? a : 1.0f;
+                current.color[c][p] = image.pixels[3*p + c] / factor[3*p + c];
+            }
+            float f = luminance(factor[3*p], factor[3*p + 1], factor[3*p + 2]);
+            current.variance[p] = variance[p] / (f * f);
+        }
+
+        // Depth gradients let the depth test accept the slope of a surface.
+        std::vector<float> gradient_x(count), gradient_y(count);
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                size_t p = size_t(y) * width + x;
+                int x0 = std::max(x - 1, 0), x1 = std::min(x + 1, width - 1);
+                int y0 = std::max(y - 1, 0), y1 = std::min(y + 1, height - 1);
+                gradient_x[p] = std::fabs(aux.depth[size_t(y)*width + x1] - aux.depth[size_t(y)*width + x0])
+                              / std::max(x1 - x0, 1);
+                gradient_y[p] = std::fabs(aux.depth[size_t(y1)*width + x] - aux.depth[size_t(y0)*width + x])
+                              / std::max(y1 - y0, 1);
+            }
+        }
+
+        std::vector<float> noise(count);
+        for (int i = 0; i < iterations; i++) {
+            blur_variance(current.variance, noise, width, height);
+
+            int step = 1 << i;
+            pool.parallel_for(height, [&](int y) {
+                filter_row(y, step, current, next, noise, aux, gradient_x, gradient_y, width, height);
+            });
+            std::swap(current, next);
+        }
+
+        image_buffer result(width, height);
+        for (size_t p = 0; p < count; p++) {
+            for (int c = 0; c < 3; c++)
+                result.pixels[3*p + c] = current.color[c][p] * factor[3*p + c];
+        }
+        return result;
+    }
+
+  private:
+    // The filtered image, one plane per channel, and its variance
+    struct planes {
+        std::vector<float> color[3];
+        std::vector<float> variance;
+
+        explicit planes(size_t count) : variance(count) {
+            for (auto& plane : color)
+                plane.resize(count);
+        }
+    };
+
+    static float luminance(float r, float g, float b) {
+        return 0.2126f*r + 0.7152f*g + 0.0722f*b;
+    }
+
+    // A 3x3 Gaussian blur; a single pixel's variance estimate is too noisy to
+    // steer the filter on its own.
+    static void blur_variance(const std::vector<float>& in, std::vector<float>& out, int width, int height) {
+        static const float kernel[3] = {0.25f, 0.5f, 0.25f};
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                float sum = 0, weight = 0;
+                for (int dy = -1; dy <= 1; dy++) {
+                    int yy = y + dy;
+                    if (yy < 0 || yy >= height)
+                        continue;
+                    for (int dx = -1; dx <= 1; dx++) {
+                        int xx = x + dx;
+                        if (xx < 0 || xx >= width)
+                            continue;
+                        float k = kernel[dx + 1] * kernel[dy + 1];
+                        sum += k * in[size_t(yy) * width + xx];
+                        weight += k;
+                    }
+                }
+                out[size_t(y) * width + x] = sum / weight;
+            }
+        }
+    }
+
+    void filter_row(int y, int step, const planes& in, planes& out, const std::vector<float>& noise,
+                    const aux_buffers& aux, const std::vector<float>& gradient_x,
+                    const std::vector<float>& gradient_y, int width, int height) const {
+        static const float kernel[5] = {1.0f/16, 1.0f/4, 3.0f/8, 1.0f/4, 1.0f/16};
+        const float* normal = aux.normal.pixels.data();
+        const float* depth = aux.depth.data();
+
+        for (int x = 0; x < width; x++) {
+            size_t p = size_t(y) * width + x;
+
+            float center_weight = kernel[2] * kernel[2];
+            float sum[3] = {center_weight * in.color[0][p], center_weight * in.color[1][p],
+                            center_weight * in.color[2][p]};
+            float variance_sum = center_weight * center_weight * in.variance[p];
+            float weight_sum = center_weight;
+
+            float lp = luminance(in.color[0][p], in.color[1][p], in.color[2][p]);
+            float luminance_scale = 1 / (sigma_luminance * std::sqrt(std::max(noise[p], 0.0f)) + 1e-6f);
+            const float* np = normal + 3*p;
+            float dp = depth[p];
+
+            for (int j = -2; j <= 2; j++) {
+                int yy = y + j * step;
+                if (yy < 0 || yy >= height)
+                    continue;
+
+                for (int i = -2; i <= 2; i++) {
+                    int xx = x + i * step;
+                    if ((i == 0 && j == 0) || xx < 0 || xx >= width)
+                        continue;
+
+                    size_t q = size_t(yy) * width + xx;
+                    const float* nq = normal + 3*q;
+
+                    float facing = std::max(0.0f, np[0]*nq[0] + np[1]*nq[1] + np[2]*nq[2]);
+                    if (facing <= 0)
+                        continue;
+
+                    float lq = luminance(in.color[0][q], in.color[1][q], in.color[2][q]);
+                    float depth_scale = sigma_depth * step
+                                      * (gradient_x[p] * std::abs(i) + gradient_y[p] * std::abs(j))
+                                      + 1e-3f * dp + 1e-6f;
+
+                    float w = kernel[i + 2] * kernel[j + 2]
+                            * std::pow(facing, sigma_normal)
+                            * std::exp(-std::fabs(lp - lq) * luminance_scale
+                                       - std::fabs(dp - depth[q]) / depth_scale);
+
+                    for (int c = 0; c < 3; c++)
+                        sum[c] += w * in.color[c][q];
+                    variance_sum += w * w * in.variance[q];
+                    weight_sum += w;
+                }
+            }
+
+            for (int c = 0; c < 3; c++)
+                out.color[c][p] = sum[c] / weight_sum;
+            out.variance[p] = variance_sum / (weight_sum * weight_sum);
+        }
+    }
+};
+
+#endif
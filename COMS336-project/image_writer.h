@@ -0,0 +1,279 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+#include "color.h"
+
+#include <algorithm>
+#include <array>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+    #include <fcntl.h>
+    #include <io.h>
+#endif
+
+enum class image_format {
+    ppm_ascii,  // P3, the original text output
+    ppm,        // P6, binary 8-bit
+    pfm,        // Portable float map, keeps the linear HDR values
+    png         // 8-bit, uncompressed deflate
+};
+
+// A rendered image: linear RGB, three floats per pixel, rows from the top.
+struct image_buffer {
+    int width = 0;
+    int height = 0;
+    std::vector<float> pixels;
+
+    image_buffer() {}
+
+    image_buffer(int width, int height)
+      : width(width), height(height), pixels(size_t(width) * height * 3, 0.0f) {}
+
+    float* at(int x, int y) { return &pixels[3 * (size_t(y) * width + x)]; }
+    const float* at(int x, int y) const { return &pixels[3 * (size_t(y) * width + x)]; }
+};
+
+// Encodes and writes images on a background thread, so the renderer only pays
+// for handing over the buffer.
+class image_writer {
+  public:
+    image_writer() {}
+
+    ~image_writer() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        changed.notify_all();
+
+        if (worker.joinable())
+            worker.join();
+    }
+
+    image_writer(const image_writer&) = delete;
+    image_writer& operator=(const image_writer&) = delete;
+
+    // Queues the image and returns at once. An empty filename writes to stdout.
+    void write(image_buffer image, image_format format, const std::string& filename) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!worker.joinable())
+                worker = std::thread([this] { run(); });
+            jobs.push_back({std::move(image), format, filename});
+        }
+        changed.notify_all();
+    }
+
+    // Blocks until every queued image has been written.
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this] { return jobs.empty() && !busy; });
+    }
+
+    // Picks the format from a filename's extension, with binary PPM as the default.
+    static image_format format_for(const std::string& filename) {
+        auto dot = filename.rfind('.');
+        auto extension = dot == std::string::npos ? std::string() : filename.substr(dot + 1);
+        if (extension == "pfm") return image_format::pfm;
+        if (extension == "png") return image_format::png;
+        return image_format::ppm;
+    }
+
+    static void encode(std::ostream& out, const image_buffer& image, image_format format) {
+        switch (format) {
+            case image_format::ppm_ascii: write_ppm_ascii(out, image); break;
+            case image_format::ppm:       write_ppm(out, image);       break;
+            case image_format::pfm:       write_pfm(out, image);       break;
+            case image_format::png:       write_png(out, image);       break;
+        }
+    }
+
+  private:
+    struct job {
+        image_buffer image;
+        image_format format;
+        std::string  filename;
+    };
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<job> jobs;
+    std::thread worker;
+    bool busy = false;
+    bool stopping = false;
+
+    void run() {
+        while (true) {
+            job next;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [this] { return stopping || !jobs.empty(); });
+                if (jobs.empty())
+                    return;
+
+                next = std::move(jobs.front());
+                jobs.pop_front();
+                busy = true;
+            }
+
+            save(next);
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                busy = false;
+            }
+            changed.notify_all();
+        }
+    }
+
+    static void save(const job& j) {
+        if (j.filename.empty()) {
+#ifdef _WIN32
+            _setmode(_fileno(stdout), _O_BINARY);
+#endif
+            encode(std::cout, j.image, j.format);
+            std::cout.flush();
+            return;
+        }
+
+        std::ofstream out(j.filename, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            std::cerr << "ERROR: Could not write image: " << j.filename << std::endl;
+            return;
+        }
+        encode(out, j.image, j.format);
+    }
+
+    static std::vector<unsigned char> to_bytes(const image_buffer& image) {
+        std::vector<unsigned char> bytes(image.pixels.size());
+        for (size_t i = 0; i < bytes.size(); i++)
+            bytes[i] = (unsigned char)(color_byte(image.pixels[i]));
+        return bytes;
+    }
+
+    static void write_ppm_ascii(std::ostream& out, const image_buffer& image) {
+        out << "P3\n" << image.width << ' ' << image.height << "\n255\n";
+        for (int y = 0; y < image.height; y++) {
+            for (int x = 0; x < image.width; x++) {
+                const float* p = image.at(x, y);
+                write_color(out, color(p[0], p[1], p[2]));
+            }
+        }
+    }
+
+    static void write_ppm(std::ostream& out, const image_buffer& image) {
+        auto bytes = to_bytes(image);
+        out << "P6\n" << image.width << ' ' << image.height << "\n255\n";
+        out.write(reinterpret_cast<const char*>(bytes.data()), std::streamsize(bytes.size()));
+    }
+
+    // PFM stores rows bottom to top; a negative scale marks little-endian data.
+    static void write_pfm(std::ostream& out, const image_buffer& image) {
+        out << "PF\n" << image.width << ' ' << image.height << "\n-1.0\n";
+        for (int y = image.height - 1; y >= 0; y--) {
+            for (size_t i = 0; i < size_t(image.width) * 3; i++) {
+                uint32_t bits;
+                std::memcpy(&bits, image.at(0, y) + i, sizeof(bits));
+                unsigned char le[4] = {
+                    (unsigned char)(bits), (unsigned char)(bits >> 8),
+                    (unsigned char)(bits >> 16), (unsigned char)(bits >> 24)
+                };
+                out.write(reinterpret_cast<const char*>(le), 4);
+            }
+        }
+    }
+
+    static uint32_t crc32(const unsigned char* data, size_t size) {
+        static const std::array<uint32_t, 256> table = [] {
+            std::array<uint32_t, 256> t;
+            for (uint32_t n = 0; n < 256; n++) {
+                uint32_t c = n;
+                for (int k = 0; k < 8; k++)
+                    c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+                t[n] = c;
+            }
+            return t;
+        }();
+
+        uint32_t crc = 0xffffffffu;
+        for (size_t i = 0; i < size; i++)
+            crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+        return ~crc;
+    }
+
+    static void put_u32(std::vector<unsigned char>& out, uint32_t value) {
+        out.push_back((unsigned char)(value >> 24));
+        out.push_back((unsigned char)(value >> 16));
+        out.push_back((unsigned char)(value >> 8));
+        out.push_back((unsigned char)(value));
+    }
+
+    static void write_chunk(std::ostream& out, const char* type, const std::vector<unsigned char>& data) {
+        std::vector<unsigned char> chunk;
+        put_u32(chunk, uint32_t(data.size()));
+        chunk.insert(chunk.end(), type, type + 4);
+        chunk.insert(chunk.end(), data.begin(), data.end());
+        put_u32(chunk, crc32(chunk.data() + 4, chunk.size() - 4));
+        out.write(reinterpret_cast<const char*>(chunk.data()), std::streamsize(chunk.size()));
+    }
+
+    // The image data goes into stored (uncompressed) deflate blocks, which
+    // keeps the encoder tiny and as fast as a copy.
+    static void write_png(std::ostream& out, const image_buffer& image) {
+        static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+        out.write(reinterpret_cast<const char*>(signature), 8);
+
+        std::vector<unsigned char> header;
+        put_u32(header, uint32_t(image.width));
+        put_u32(header, uint32_t(image.height));
+        header.insert(header.end(), {8, 2, 0, 0, 0});  // 8-bit RGB, no interlace
+        write_chunk(out, "IHDR", header);
+
+        // Every row starts with filter type 0 (none).
+        auto bytes = to_bytes(image);
+        size_t row_size = size_t(image.width) * 3;
+        std::vector<unsigned char> raw;
+        raw.reserve((row_size + 1) * image.height);
+        for (int y = 0; y < image.height; y++) {
+            raw.push_back(0);
+            raw.insert(raw.end(), bytes.begin() + y * row_size, bytes.begin() + (y + 1) * row_size);
+        }
+
+        std::vector<unsigned char> zlib = {0x78, 0x01};
+        uint32_t a = 1, b = 0;
+        for (auto byte : raw) {
+            a = (a + byte) % 65521;
+            b = (b + a) % 65521;
+        }
+
+        const size_t max_block = 65535;
+        size_t offset = 0;
+        do {
+            size_t length = std::min(max_block, raw.size() - offset);
+            bool last = offset + length == raw.size();
+            zlib.push_back(last ? 1 : 0);
+            zlib.push_back((unsigned char)(length));
+            zlib.push_back((unsigned char)(length >> 8));
+            zlib.push_back((unsigned char)(~length));
+            zlib.push_back((unsigned char)(~length >> 8));
+            zlib.insert(zlib.end(), raw.begin() + offset, raw.begin() + offset + length);
+            offset += length;
+        } while (offset < raw.size());
+        put_u32(zlib, (b << 16) | a);
+
+        write_chunk(out, "IDAT", zlib);
+        write_chunk(out, "IEND", {});
+    }
+};
+
+#endif
@@ -1,5 +1,10 @@
 #include <iostream>
+#include <map>
+#include <memory>
+#include <vector>
 
+#include "asset_cache.h"
+#include "batch.h"
 #include "bvh.h"
 #include "camera.h"
 #include "constant_medium.h"
@@ -16,31 +21,28 @@
 
 void setup_common_scene(canbehit_list& world) {
     // Materials
-    auto chrome = make_shared<metal>(color(0.8, 0.8, 0.8), 0.1);
-    auto glass = make_shared<dielectric>(1.5);
-    auto red_matte = make_shared<lambertian>(color(0.7, 0.3, 0.3));
-    auto light = make_shared<diffuse_light>(color(4, 4, 4));
+    auto chrome = make_scene_object<metal>(color(0.8, 0.8, 0.8), 0.1);
+    auto glass = make_scene_object<dielectric>(1.5);
+    auto red_matte = make_scene_object<lambertian>(color(0.7, 0.3, 0.3));
+    auto light = make_scene_object<diffuse_light>(color(4, 4, 4));
     
     // Main objects
-    world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, glass));        // Center glass sphere
-    world.add(make_shared<sphere>(point3(-2, 0.5, 1), 0.5, chrome));     // Left metal sphere
-    world.add(make_shared<sphere>(point3(2, 0.5, -1), 0.5, red_matte)); // Right red sphere
+    world.add(make_scene_object<sphere>(point3(0, 1, 0), 1.0, glass));        // Center glass sphere
+    world.add(make_scene_object<sphere>(point3(-2, 0.5, 1), 0.5, chrome));     // Left metal sphere
+    world.add(make_scene_object<sphere>(point3(2, 0.5, -1), 0.5, red_matte)); // Right red sphere
     
     // Light source
-    world.add(make_shared<quad>(point3(-1, 4, -1), vec3(2,0,0), vec3(0,0,2), light));
+    world.add(make_scene_object<quad>(point3(-1, 4, -1), vec3(2,0,0), vec3(0,0,2), light));
     
     // Ground plane
-    auto checker = make_shared<checker_texture>(0.5, color(.2, .3, .1), color(.9, .9, .9));
-    auto ground = make_shared<lambertian>(checker);
-    world.add(make_shared<quad>(point3(-5, 0, -5), vec3(10,0,0), vec3(0,0,10), ground));
+    auto checker = make_scene_object<checker_texture>(0.5, color(.2, .3, .1), color(.9, .9, .9));
+    auto ground = make_scene_object<lambertian>(checker);
+    world.add(make_scene_object<quad>(point3(-5, 0, -5), vec3(10,0,0), vec3(0,0,10), ground));
 }
 
-void figure_2() {
-    canbehit_list world;
+void figure_2(canbehit_list& world, camera& cam) {
     setup_common_scene(world);
 
-    camera cam;
-
     // Basic camera settings
     cam.aspect_ratio = 16.0 / 9.0;
     cam.image_width = 400;
@@ -59,16 +61,11 @@ void figure_2() {
 
     // Basic background
     cam.background = color(0.7, 0.8, 1.0);
-
-    cam.render(world);
 }
 
-void figure_3() {
-    canbehit_list world;
+void figure_3(canbehit_list& world, camera& cam) {
     setup_common_scene(world);
 
-    camera cam;
-
     // Enhanced settings
     cam.aspect_ratio = 16.0 / 9.0;
     cam.image_width = 400;
@@ -87,25 +84,18 @@ void figure_3() {
 
     // Dramatic background
     cam.background = color(0.1, 0.1, 0.2);
-
-    cam.render(world);
 }
 
-void figure_4() {
-    // Scene setup
-    canbehit_list world;
-
+void figure_4(canbehit_list& world, camera& cam) {
     // Single sphere with basic material
-    auto sphere_material = make_shared<lambertian>(color(0.7, 0.3, 0.3));  // Simple red diffuse
-    world.add(make_shared<sphere>(point3(0, 0, 0), 1.0, sphere_material));
+    auto sphere_material = make_scene_object<lambertian>(color(0.7, 0.3, 0.3));  // Simple red diffuse
+    world.add(make_scene_object<sphere>(point3(0, 0, 0), 1.0, sphere_material));
 
     // Add simple light source
-    auto light = make_shared<diffuse_light>(color(15, 15, 15));  // Increased light intensity
-    world.add(make_shared<quad>(point3(-2, 2, -2), vec3(4,0,0), vec3(0,0,4), light));
+    auto light = make_scene_object<diffuse_light>(color(15, 15, 15));  // Increased light intensity
+    world.add(make_scene_object<quad>(point3(-2, 2, -2), vec3(4,0,0), vec3(0,0,4), light));
 
     // Camera setup - minimal settings
-    camera cam;
-
     // Basic image settings
     cam.aspect_ratio = 16.0 / 9.0;
     cam.image_width = 400;
@@ -123,29 +113,21 @@ void figure_4() {
 
     // Simple background
     cam.background = color(0.7, 0.7, 0.7);  // Gray background
-
-    // Render
-    cam.render(world);
 }
 
-void figure_5() {
-    // Scene setup
-    canbehit_list world;
-
+void figure_5(canbehit_list& world, camera& cam) {
     // Single quad with basic material
-    auto quad_material = make_shared<lambertian>(color(0.3, 0.7, 0.3));  // Simple green diffuse
-    world.add(make_shared<quad>(point3(-1, -1, 0),     // Lower left corner
+    auto quad_material = make_scene_object<lambertian>(color(0.3, 0.7, 0.3));  // Simple green diffuse
+    world.add(make_scene_object<quad>(point3(-1, -1, 0),     // Lower left corner
                                vec3(2, 0, 0),           // Width vector (2 units wide)
                                vec3(0, 2, 0),           // Height vector (2 units tall)
                                quad_material));
 
     // Add simple light source
-    auto light = make_shared<diffuse_light>(color(5, 5, 5));
-    world.add(make_shared<quad>(point3(-2, 2, -2), vec3(4,0,0), vec3(0,0,4), light));
+    auto light = make_scene_object<diffuse_light>(color(5, 5, 5));
+    world.add(make_scene_object<quad>(point3(-2, 2, -2), vec3(4,0,0), vec3(0,0,4), light));
 
     // Camera setup - minimal settings
-    camera cam;
-
     // Basic image settings
     cam.aspect_ratio = 16.0 / 9.0;
     cam.image_width = 400;
@@ -163,32 +145,24 @@ void figure_5() {
 
     // Simple background
     cam.background = color(0.7, 0.7, 0.7);  // Gray background
-
-    // Render
-    cam.render(world);
 }
 
-void figure_6() {
-    // Scene setup
-    canbehit_list world;
-
+void figure_6(canbehit_list& world, camera& cam) {
     // Single triangle with basic material
-    auto triangle_material = make_shared<lambertian>(color(0.3, 0.7, 0.3));  // Simple green diffuse
+    auto triangle_material = make_scene_object<lambertian>(color(0.3, 0.7, 0.3));  // Simple green diffuse
     
     // Define triangle vertices
     point3 v0(-1, -1, 0);    // Bottom left
     point3 v1(1, -1, 0);     // Bottom right
     point3 v2(0, 1, 0);      // Top center
     
-    world.add(make_shared<triangle>(v0, v1, v2, triangle_material));
+    world.add(make_scene_object<triangle>(v0, v1, v2, triangle_material));
 
     // Add simple light source
-    auto light = make_shared<diffuse_light>(color(5, 5, 5));
-    world.add(make_shared<quad>(point3(-2, 2, -2), vec3(4,0,0), vec3(0,0,4), light));
+    auto light = make_scene_object<diffuse_light>(color(5, 5, 5));
+    world.add(make_scene_object<quad>(point3(-2, 2, -2), vec3(4,0,0), vec3(0,0,4), light));
 
     // Camera setup - minimal settings
-    camera cam;
-
     // Basic image settings
     cam.aspect_ratio = 16.0 / 9.0;
     cam.image_width = 400;
@@ -206,28 +180,20 @@ void figure_6() {
 
     // Simple background
     cam.background = color(0.7, 0.7, 0.7);  // Gray background
-
-    // Render
-    cam.render(world);
 }
 
-void figure_7() {
-    // Scene setup
-    canbehit_list world;
-
+void figure_7(canbehit_list& world, camera& cam) {
     // Blue material for the mesh
-    auto mesh_material = make_shared<lambertian>(color(0.3, 0.3, 0.8));  // Changed to blue
+    auto mesh_material = make_scene_object<lambertian>(color(0.3, 0.3, 0.8));  // Changed to blue
 
     // Add Nefertiti mesh directly
-    world.add(make_shared<mesh>("meshes/Nefertiti.obj", mesh_material));
+    world.add(load_mesh("meshes/Nefertiti.obj", mesh_material));
 
     // Add light source (toned down)
-    auto light = make_shared<diffuse_light>(color(7, 7, 7));  // Reduced intensity
-    world.add(make_shared<quad>(point3(-2, 4, -2), vec3(4,0,0), vec3(0,0,4), light));
+    auto light = make_scene_object<diffuse_light>(color(7, 7, 7));  // Reduced intensity
+    world.add(make_scene_object<quad>(point3(-2, 4, -2), vec3(4,0,0), vec3(0,0,4), light));
 
     // Camera setup
-    camera cam;
-
     // Basic image settings
     cam.aspect_ratio = 16.0 / 9.0;
     cam.image_width = 400;
@@ -245,40 +211,32 @@ void figure_7() {
 
     // Background
     cam.background = color(0.7, 0.7, 0.7);
-
-    // Render
-    cam.render(world);
 }
 
-void figure_8() {
-    // Scene setup
-    canbehit_list world;
-
+void figure_8(canbehit_list& world, camera& cam) {
     // Create the four different textures
-    auto solid_texture = make_shared<solid_color>(color(0.2, 0.3, 0.7));
-    auto checker_text = make_shared<checker_texture>(0.5, color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9));
-    auto image_text = make_shared<image_texture>("images/max_pizza.jpg");
-    auto noise_text = make_shared<noise_texture>(1.5);
+    auto solid_texture = make_scene_object<solid_color>(color(0.2, 0.3, 0.7));
+    auto checker_text = make_scene_object<checker_texture>(0.5, color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9));
+    auto image_text = make_scene_object<image_texture>("images/max_pizza.jpg");
+    auto noise_text = make_scene_object<noise_texture>(1.5);
 
     // Create materials using these textures
-    auto solid_mat = make_shared<lambertian>(solid_texture);
-    auto checker_mat = make_shared<lambertian>(checker_text);
-    auto image_mat = make_shared<lambertian>(image_text);
-    auto noise_mat = make_shared<lambertian>(noise_text);
+    auto solid_mat = make_scene_object<lambertian>(solid_texture);
+    auto checker_mat = make_scene_object<lambertian>(checker_text);
+    auto image_mat = make_scene_object<lambertian>(image_text);
+    auto noise_mat = make_scene_object<lambertian>(noise_text);
 
     // Add four spheres with different textures - spread them out less
-    world.add(make_shared<sphere>(point3(-1, 0, -1), 0.7, solid_mat));     // Left back
-    world.add(make_shared<sphere>(point3(1, 0, -1), 0.7, checker_mat));    // Right back
-    world.add(make_shared<sphere>(point3(-1, 0, 1), 0.7, image_mat));      // Left front
-    world.add(make_shared<sphere>(point3(1, 0, 1), 0.7, noise_mat));       // Right front
+    world.add(make_scene_object<sphere>(point3(-1, 0, -1), 0.7, solid_mat));     // Left back
+    world.add(make_scene_object<sphere>(point3(1, 0, -1), 0.7, checker_mat));    // Right back
+    world.add(make_scene_object<sphere>(point3(-1, 0, 1), 0.7, image_mat));      // Left front
+    world.add(make_scene_object<sphere>(point3(1, 0, 1), 0.7, noise_mat));       // Right front
 
     // Add light source - make it brighter and wider
-    auto light = make_shared<diffuse_light>(color(15, 15, 15));
-    world.add(make_shared<quad>(point3(-4, 4, -4), vec3(8,0,0), vec3(0,0,8), light));
+    auto light = make_scene_object<diffuse_light>(color(15, 15, 15));
+    world.add(make_scene_object<quad>(point3(-4, 4, -4), vec3(8,0,0), vec3(0,0,8), light));
 
     // Camera setup
-    camera cam;
-
     // Basic image settings
     cam.aspect_ratio = 16.0 / 9.0;
     cam.image_width = 400;
@@ -296,34 +254,26 @@ void figure_8() {
 
     // Background
     cam.background = color(0.2, 0.2, 0.2);  // Darker background for contrast
-
-    // Render
-    cam.render(world);
 }
 
-void figure_9() {
-    // Scene setup
-    canbehit_list world;
-
+void figure_9(canbehit_list& world, camera& cam) {
     // Create materials
-    auto diffuse = make_shared<lambertian>(color(0.7, 0.3, 0.3));       // Red diffuse
-    auto specular = make_shared<metal>(color(0.8, 0.8, 0.8), 0.0);      // Perfect mirror
-    auto dielectr = make_shared<dielectric>(1.5);                      // Glass
-    auto emissive = make_shared<diffuse_light>(color(4, 3, 2));         // Glowing orange
+    auto diffuse = make_scene_object<lambertian>(color(0.7, 0.3, 0.3));       // Red diffuse
+    auto specular = make_scene_object<metal>(color(0.8, 0.8, 0.8), 0.0);      // Perfect mirror
+    auto dielectr = make_scene_object<dielectric>(1.5);                      // Glass
+    auto emissive = make_scene_object<diffuse_light>(color(4, 3, 2));         // Glowing orange
 
     // Add four spheres with different materials
-    world.add(make_shared<sphere>(point3(-1, 0, -1), 0.7, diffuse));     // Left back
-    world.add(make_shared<sphere>(point3(1, 0, -1), 0.7, specular));     // Right back
-    world.add(make_shared<sphere>(point3(-1, 0, 1), 0.7, dielectr));   // Left front
-    world.add(make_shared<sphere>(point3(1, 0, 1), 0.7, emissive));      // Right front
+    world.add(make_scene_object<sphere>(point3(-1, 0, -1), 0.7, diffuse));     // Left back
+    world.add(make_scene_object<sphere>(point3(1, 0, -1), 0.7, specular));     // Right back
+    world.add(make_scene_object<sphere>(point3(-1, 0, 1), 0.7, dielectr));   // Left front
+    world.add(make_scene_object<sphere>(point3(1, 0, 1), 0.7, emissive));      // Right front
 
     // Add light source (dimmer since we have an emissive sphere)
-    auto light = make_shared<diffuse_light>(color(10, 10, 10));
-    world.add(make_shared<quad>(point3(-4, 4, -4), vec3(8,0,0), vec3(0,0,8), light));
+    auto light = make_scene_object<diffuse_light>(color(10, 10, 10));
+    world.add(make_scene_object<quad>(point3(-4, 4, -4), vec3(8,0,0), vec3(0,0,8), light));
 
     // Camera setup
-    camera cam;
-
     // Basic image settings
     cam.aspect_ratio = 16.0 / 9.0;
     cam.image_width = 400;
@@ -341,32 +291,24 @@ void figure_9() {
 
     // Dark background to show emissive material better
     cam.background = color(0.1, 0.1, 0.1);
-
-    // Render
-    cam.render(world);
 }
 
-void figure_10() {
-    // Scene setup
-    canbehit_list world;
-
+void figure_10(canbehit_list& world, camera& cam) {
     // Create materials
-    auto still_mat = make_shared<lambertian>(color(0.2, 0.8, 0.2));     // Green for still sphere
-    auto motion_mat = make_shared<metal>(color(0.8, 0.2, 0.2), 0.0);    // Red metal for moving sphere
+    auto still_mat = make_scene_object<lambertian>(color(0.2, 0.8, 0.2));     // Green for still sphere
+    auto motion_mat = make_scene_object<metal>(color(0.8, 0.2, 0.2), 0.0);    // Red metal for moving sphere
 
     // Add still sphere
-    world.add(make_shared<sphere>(point3(-1, 0, 0), 0.7, still_mat));
+    world.add(make_scene_object<sphere>(point3(-1, 0, 0), 0.7, still_mat));
 
     // Add moving sphere (motion blur from time 0 to 1)
-    world.add(make_shared<sphere>(point3(1, 0, -1), point3(1, 0, 1), 0.7, motion_mat));
+    world.add(make_scene_object<sphere>(point3(1, 0, -1), point3(1, 0, 1), 0.7, motion_mat));
 
     // Add light source
-    auto light = make_shared<diffuse_light>(color(10, 10, 10));
-    world.add(make_shared<quad>(point3(-4, 4, -4), vec3(8,0,0), vec3(0,0,8), light));
+    auto light = make_scene_object<diffuse_light>(color(10, 10, 10));
+    world.add(make_scene_object<quad>(point3(-4, 4, -4), vec3(8,0,0), vec3(0,0,8), light));
 
     // Camera setup
-    camera cam;
-
     // Basic image settings
     cam.aspect_ratio = 16.0 / 9.0;
     cam.image_width = 400;
@@ -384,82 +326,76 @@ void figure_10() {
 
     // Background
     cam.background = color(0.2, 0.2, 0.2);
-
-    // Render
-    cam.render(world);
 }
 
-void figure_1() {
-    // Scene setup
-    canbehit_list world;
-
-    auto grass_texture = make_shared<image_texture>("grass-texture.jpg");
-    auto grass_mat = make_shared<lambertian>(grass_texture);
-    auto trunk_texture = make_shared<image_texture>("wood-texture.jpg");
-    auto trunk_mat = make_shared<lambertian>(trunk_texture);
-    auto building_texture = make_shared<image_texture>("stone-brick.jpg");
-    auto building_mat = make_shared<lambertian>(building_texture);
-    auto leaves_texture = make_shared<image_texture>("leaves.jpg");
-    auto leaves_mat = make_shared<lambertian>(leaves_texture);
-    auto road_texture = make_shared<image_texture>("gravel.jpg");
-    auto road_mat = make_shared<lambertian>(road_texture);
+void figure_1(canbehit_list& world, camera& cam) {
+    auto grass_texture = make_scene_object<image_texture>("grass-texture.jpg");
+    auto grass_mat = make_scene_object<lambertian>(grass_texture);
+    auto trunk_texture = make_scene_object<image_texture>("wood-texture.jpg");
+    auto trunk_mat = make_scene_object<lambertian>(trunk_texture);
+    auto building_texture = make_scene_object<image_texture>("stone-brick.jpg");
+    auto building_mat = make_scene_object<lambertian>(building_texture);
+    auto leaves_texture = make_scene_object<image_texture>("leaves.jpg");
+    auto leaves_mat = make_scene_object<lambertian>(leaves_texture);
+    auto road_texture = make_scene_object<image_texture>("gravel.jpg");
+    auto road_mat = make_scene_object<lambertian>(road_texture);
 
     // Create materials
-    auto red_mat = make_shared<lambertian>(color(0.8, 0.2, 0.2));    // Bright red for truck
-    auto sun_mat = make_shared<diffuse_light>(color(30, 16, 6));    // Orange-yellow sun
+    auto red_mat = make_scene_object<lambertian>(color(0.8, 0.2, 0.2));    // Bright red for truck
+    auto sun_mat = make_scene_object<diffuse_light>(color(30, 16, 6));    // Orange-yellow sun
 
     // Add truck mesh
-    auto truck = make_shared<mesh>("meshes/Cybertruck.obj", red_mat);
+    auto truck = load_mesh("meshes/Cybertruck.obj", red_mat);
     world.add(truck);
 
     // Add building (tall box) behind the truck
     shared_ptr<canbehit> building = box(point3(0,0,0), point3(8,15,4), building_mat);
-    auto moved_building = make_shared<translate>(building, vec3(-15, 0, -4));
+    auto moved_building = make_scene_object<translate>(building, vec3(-15, 0, -4));
     world.add(moved_building);
-    auto moved_building2 = make_shared<translate>(building, vec3(-15, 0, -14));
+    auto moved_building2 = make_scene_object<translate>(building, vec3(-15, 0, -14));
     world.add(moved_building2);
-    auto moved_building3 = make_shared<translate>(building, vec3(-15, 0, 6));
+    auto moved_building3 = make_scene_object<translate>(building, vec3(-15, 0, 6));
     world.add(moved_building3);
 
     // Add tree (trunk and leaves)
     shared_ptr<canbehit> trunk = box(point3(0,0,0), point3(1,4,1), trunk_mat);
-    auto moved_trunk = make_shared<translate>(trunk, vec3(-8, 0, 4));
+    auto moved_trunk = make_scene_object<translate>(trunk, vec3(-8, 0, 4));
     world.add(moved_trunk);
 
     // Add tree leaves (sphere on top of trunk)
-    auto leaves = make_shared<sphere>(point3(-8, 5, 4), 2.5, leaves_mat);
+    auto leaves = make_scene_object<sphere>(point3(-8, 5, 4), 2.5, leaves_mat);
     world.add(leaves);
 
     // Add tree (trunk and leaves)
     shared_ptr<canbehit> trunk2 = box(point3(0,0,0), point3(.5,2.5,.5), trunk_mat);
-    auto moved_trunk2 = make_shared<translate>(trunk2, vec3(-4, 0, 8));
+    auto moved_trunk2 = make_scene_object<translate>(trunk2, vec3(-4, 0, 8));
     world.add(moved_trunk2);
 
     // Add tree leaves (sphere on top of trunk)
-    auto leaves2 = make_shared<sphere>(point3(-3.5, 2.5, 8), 1.5, leaves_mat);
+    auto leaves2 = make_scene_object<sphere>(point3(-3.5, 2.5, 8), 1.5, leaves_mat);
     world.add(leaves2);
 
     // Add tree (trunk and leaves)
     shared_ptr<canbehit> trunk3 = box(point3(0,0,0), point3(1,3,1), trunk_mat);
-    auto moved_trunk3 = make_shared<translate>(trunk3, vec3(-6, 0, -8));
+    auto moved_trunk3 = make_scene_object<translate>(trunk3, vec3(-6, 0, -8));
     world.add(moved_trunk3);
 
     // Add tree leaves (sphere on top of trunk)
-    auto leaves3 = make_shared<sphere>(point3(-6, 4, -8), 2, leaves_mat);
+    auto leaves3 = make_scene_object<sphere>(point3(-6, 4, -8), 2, leaves_mat);
     world.add(leaves3);
 
     // Add multiple overlapping smoke volumes for puffier effect
-    auto smoke_boundary1 = make_shared<sphere>(point3(-1.5, 0.3, -5), 1.0, 
-                                             make_shared<dielectric>(1.5));
-    world.add(make_shared<constant_medium>(smoke_boundary1, 1.5, color(0.5, 0.5, 0.5)));
+    auto smoke_boundary1 = make_scene_object<sphere>(point3(-1.5, 0.3, -5), 1.0, 
+                                             make_scene_object<dielectric>(1.5));
+    world.add(make_scene_object<constant_medium>(smoke_boundary1, 1.5, color(0.5, 0.5, 0.5)));
 
-    auto smoke_boundary2 = make_shared<sphere>(point3(-1.7, 0.4, -4.5), 0.8, 
-                                             make_shared<dielectric>(1.5));
-    world.add(make_shared<constant_medium>(smoke_boundary2, 2.0, color(0.6, 0.6, 0.6)));
+    auto smoke_boundary2 = make_scene_object<sphere>(point3(-1.7, 0.4, -4.5), 0.8, 
+                                             make_scene_object<dielectric>(1.5));
+    world.add(make_scene_object<constant_medium>(smoke_boundary2, 2.0, color(0.6, 0.6, 0.6)));
 
-    auto smoke_boundary3 = make_shared<sphere>(point3(-1.3, 0.2, -5.5), 0.7, 
-                                             make_shared<dielectric>(1.5));
-    world.add(make_shared<constant_medium>(smoke_boundary3, 1.8, color(0.4, 0.4, 0.4)));
+    auto smoke_boundary3 = make_scene_object<sphere>(point3(-1.3, 0.2, -5.5), 0.7, 
+                                             make_scene_object<dielectric>(1.5));
+    world.add(make_scene_object<constant_medium>(smoke_boundary3, 1.8, color(0.4, 0.4, 0.4)));
 
     // Add "fire" spheres behind truck with motion and color variation
     for(int i = 0; i < 12; i++) {
@@ -474,27 +410,28 @@ void figure_1() {
             random_double(0.2, 0.4)
         );
         
-        auto fire_mat = make_shared<diffuse_light>(fire_color);
+        auto fire_mat = make_scene_object<diffuse_light>(fire_color);
         
         point3 center1(-1.5 + x_offset, 0.3 + y_offset, -z_offset);
         point3 center2(-1.5 + x_offset - 0.2,
                       0.3 + y_offset + random_double(-0.1, 0.1),
                       -z_offset + random_double(-0.2, 0.2));
         
-        world.add(make_shared<sphere>(center1, center2, size, fire_mat));
+        world.add(make_scene_object<sphere>(center1, center2, size, fire_mat));
     }
 
     // Add large grass ground plane
-    world.add(make_shared<quad>(point3(-50, -0.1, -50), vec3(100,0,0), vec3(0,0,100), grass_mat));
+    world.add(make_scene_object<quad>(point3(-50, -0.1, -50), vec3(100,0,0), vec3(0,0,100), grass_mat));
     // Add road
-    world.add(make_shared<quad>(point3(-3, -0.05, -50), vec3(6,0,0), vec3(0,0,100), road_mat));
+    world.add(make_scene_object<quad>(point3(-3, -0.05, -50), vec3(6,0,0), vec3(0,0,100), road_mat));
 
     // Add sunset sun - repositioned to be visible in camera view
-    world.add(make_shared<sphere>(point3(-20, 4, -8), 2.0, sun_mat));
+    world.add(make_scene_object<sphere>(point3(-20, 4, -8), 2.0, sun_mat));
 
-    // Camera setup
-    camera cam;
+    // Build an acceleration structure over the scene
+    world = canbehit_list(make_scene_object<bvh_node>(world));
 
+    // Camera setup
     // Basic image settings
     cam.aspect_ratio = 16.0 / 9.0;
     cam.image_width = 1024;
@@ -513,23 +450,89 @@ void figure_1() {
     // Darker blue for sunset sky
     cam.background = color(0.45, 0.75, 1.35);
 
-    // Render
-    cam.render(world);
+    // Long render: take samples in passes, so checkpoint=<file> can save
+    // them and an interrupted run picks up where it stopped
+    cam.samples_per_pass = 16;
 }
 
-int main() {
-    switch (1) {
-        case 1:  figure_1();   break;
-        case 2:  figure_2();  break;
-        case 3:  figure_3(); break;
-        case 4:  figure_4(); break;
-        case 5:  figure_5(); break;
-        case 6:  figure_6(); break;
-        case 7:  figure_7(); break;
-        case 8:  figure_8(); break;
-        case 9:  figure_9(); break;
-        case 10:  figure_10(); break;
-
-        default: figure_1(); break;
+typedef void (*scene_builder)(canbehit_list& world, camera& cam);
+
+const scene_builder scenes[] = {
+    figure_1, figure_2, figure_3, figure_4, figure_5,
+    figure_6, figure_7, figure_8, figure_9, figure_10
+};
+const int scene_count = int(sizeof(scenes) / sizeof(scenes[0]));
+
+// A scene's objects and the camera it renders with unless a job says otherwise.
+struct built_scene {
+    scene_arena arena;
+    canbehit_list world;
+    camera cam;
+};
+
+// Renders each job in turn. Scenes are built the first time a job asks for
+// them and kept for later jobs, and images and meshes are loaded through one
+// asset cache, so a batch of frames or figures loads every file once.
+int main(int argc, char* argv[]) {
+    std::vector<render_job> jobs;
+    if (!jobs_from_arguments(argc, argv, jobs)) {
+        std::cerr << "Usage: " << argv[0] << " [scene [name=value ...] | --jobs file]\n";
+        return 1;
+    }
+
+    asset_cache assets;
+    asset_cache::scope use_assets(assets);
+    std::map<int, std::unique_ptr<built_scene>> built;
+    std::map<int, shared_ptr<thread_pool>> pools;
+    int failed = 0;
+
+    for (size_t i = 0; i < jobs.size(); i++) {
+        const auto& job = jobs[i];
+        if (job.scene < 1 || job.scene > scene_count) {
+            std::cerr << "ERROR: No scene " << job.scene << ", skipping job " << i + 1 << std::endl;
+            failed++;
+            continue;
+        }
+
+        auto& scene = built[job.scene];
+        if (!scene) {
+            scene = std::make_unique<built_scene>();
+            scene_arena::scope use_arena(scene->arena);
+            scenes[job.scene - 1](scene->world, scene->cam);
+        }
+
+        // A checkpoint belongs to one job, so jobs that reuse a scene do not
+        // resume each other's unless they name the same file.
+        camera cam = scene->cam;
+        cam.checkpoint_file.clear();
+        if (!apply_settings(cam, job)) {
+            std::cerr << "ERROR: Skipping job " << i + 1 << std::endl;
+            failed++;
+            continue;
+        }
+
+        // Jobs that ask for the same thread count share one pool.
+        if (cam.thread_count > 0) {
+            auto& pool = pools[cam.thread_count];
+            if (!pool)
+                pool = make_shared<thread_pool>(cam.thread_count);
+            cam.workers = pool;
+        }
+
+        if (jobs.size() > 1)
+            std::clog << "Job " << i + 1 << " of " << jobs.size() << ": scene " << job.scene << '\n';
+        if (!cam.render(scene->world)) {
+            std::cerr << "ERROR: Skipping job " << i + 1 << std::endl;
+            failed++;
+        }
     }
-}
\ No newline at end of file
+
+    if (jobs.size() > 1) {
+        std::clog << "Scenes built: " << built.size() << " for " << jobs.size() << " jobs. Assets: "
+                  << assets.load_count() << " loaded, " << assets.reuse_count() << " reused. Textures: "
+                  << texture_registry::shared().image_count() << " images, "
+                  << texture_registry::shared().bytes_used() / 1024 << " KiB\n";
+    }
+    texture_tile_cache::shared().report(std::clog);
+    return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,180 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <algorithm>
+#include <cstddef>
+#include <string>
+
+#ifdef _WIN32
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+// A memory mapping of a whole file. The pages are loaded by the OS on first
+// touch, so opening even a large file is cheap. open() maps a file read-only;
+// open_writable() maps it shared and read-write, creating or resizing it first.
+class mapped_file {
+  public:
+    mapped_file() {}
+
+    mapped_file(const std::string& filename) { open(filename); }
+
+    ~mapped_file() { close(); }
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    bool open(const std::string& filename) {
+        return map(filename, false, 0);
+    }
+
+    bool open_writable(const std::string& filename, size_t size) {
+        return map(filename, true, size);
+    }
+
+    // Writes changed pages back to the file before returning.
+    bool flush() {
+        if (!bytes || !writable)
+            return true;
+#ifdef _WIN32
+        return FlushViewOfFile(bytes, 0) && FlushFileBuffers(file);
+#else
+        return msync(const_cast<char*>(bytes), length, MS_SYNC) == 0;
+#endif
+    }
+
+    // The size of a memory page on this machine: 4 KiB on most, 16 KiB on
+    // arm64 macOS and some arm64 Linux kernels.
+    static size_t page_size() {
+        static const size_t size = [] {
+#ifdef _WIN32
+            SYSTEM_INFO info;
+            GetSystemInfo(&info);
+            return size_t(info.dwPageSize);
+#else
+            long page = sysconf(_SC_PAGESIZE);
+            return page > 0 ? size_t(page) : size_t(4096);
+#endif
+        }();
+        return size;
+    }
+
+    // Tells the OS the given pages of a read-only mapping are not needed for
+    // now; they are read from the file again if touched. Only the whole pages
+    // inside the range are released. Returns false if the OS refused.
+    bool release(size_t offset, size_t size) const {
+        if (!bytes || writable || offset >= length)
+            return true;
+#ifndef _WIN32
+        size_t page = page_size();
+        size_t start = (offset + page - 1) / page * page;
+        size_t end = std::min(offset + std::min(size, length - offset), length) / page * page;
+        if (start >= end)
+            return true;
+        return madvise(const_cast<char*>(bytes) + start, end - start, MADV_DONTNEED) == 0;
+#else
+        return true;
+#endif
+    }
+
+    void close() {
+#ifdef _WIN32
+        if (bytes) UnmapViewOfFile(bytes);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (bytes) munmap(const_cast<char*>(bytes), length);
+#endif
+        bytes = nullptr;
+        length = 0;
+        is_open = false;
+        writable = false;
+    }
+
+    bool valid() const { return is_open; }
+    const char* data() const { return bytes; }
+    char* writable_data() { return writable ? const_cast<char*>(bytes) : nullptr; }
+    size_t size() const { return length; }
+
+  private:
+    const char* bytes = nullptr;
+    size_t length = 0;
+    bool is_open = false;
+    bool writable = false;
+
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#endif
+
+    bool map(const std::string& filename, bool write, size_t size) {
+        close();
+
+#ifdef _WIN32
+        file = CreateFileA(filename.c_str(), write ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ,
+                           FILE_SHARE_READ, nullptr, write ? OPEN_ALWAYS : OPEN_EXISTING,
+                           FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+
+        LARGE_INTEGER file_size;
+        GetFileSizeEx(file, &file_size);
+        if (write && size_t(file_size.QuadPart) != size) {
+            file_size.QuadPart = LONGLONG(size);
+            if (!SetFilePointerEx(file, file_size, nullptr, FILE_BEGIN) || !SetEndOfFile(file)) {
+                close();
+                return false;
+            }
+        }
+        length = size_t(file_size.QuadPart);
+
+        if (length > 0) {
+            mapping = CreateFileMappingA(file, nullptr, write ? PAGE_READWRITE : PAGE_READONLY, 0, 0, nullptr);
+            if (mapping)
+                bytes = static_cast<const char*>(MapViewOfFile(mapping, write ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 0));
+            if (!bytes) {
+                close();
+                return false;
+            }
+        }
+#else
+        int fd = write ? ::open(filename.c_str(), O_RDWR | O_CREAT, 0644) : ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+
+        struct stat info;
+        if (fstat(fd, &info) != 0 || (write && size_t(info.st_size) != size && ftruncate(fd, off_t(size)) != 0)) {
+            ::close(fd);
+            return false;
+        }
+        length = write ? size : size_t(info.st_size);
+
+        if (length > 0) {
+            void* view = write ? mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+                               : mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (view == MAP_FAILED) {
+                ::close(fd);
+                length = 0;
+                return false;
+            }
+            bytes = static_cast<const char*>(view);
+        }
+        ::close(fd);
+#endif
+
+        is_open = true;
+        writable = write;
+        return true;
+    }
+};
+
+#endif
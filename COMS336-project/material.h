@@ -3,9 +3,21 @@
 
 #include "canbehit.h"
 #include "color.h"
+#include "onb.h"
 #include "ray.h"
 #include "texture.h"
 
+// An outgoing direction picked by material::sample(). For a smooth lobe, f is
+// the BSDF times the cosine for that direction and pdf its solid-angle
+// density. A specular (delta) lobe has no density: f is then the weight of the
+// direction and pdf is 1.
+struct bsdf_sample {
+    vec3 direction;
+    color f;
+    double pdf = 0;
+    bool specular = false;
+};
+
 class material {
     public:
         virtual ~material() = default;
@@ -14,62 +26,134 @@ class material {
             return color(0,0,0);
         }
 
-        virtual bool scatter(
-            const ray& r_in, const hit_record& rec, color& att, ray& scattered
-        ) const {
+        virtual bool is_emissive() const { return false; }
+
+        // The surface color, for the denoiser's albedo buffer.
+        virtual color base_color(const hit_record& rec) const { return color(1,1,1); }
+
+        // Picks a direction to continue the path in. False if the path is
+        // absorbed.
+        virtual bool sample(const ray& r_in, const hit_record& rec, bsdf_sample& s) const {
             return false;
         }
+
+        // The BSDF times the cosine, and the density sample() has, for a given
+        // direction. Both are 0 for specular lobes, which no other direction
+        // can hit.
+        virtual color eval(const ray& r_in, const hit_record& rec, const vec3& direction) const {
+            return color(0,0,0);
+        }
+
+        virtual double pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const {
+            return 0;
+        }
 };
 
 class lambertian : public material {
     public:
-        lambertian(const color& albedo) : tex(make_shared<solid_color>(albedo)) {}
+        lambertian(const color& albedo) : tex(make_scene_object<solid_color>(albedo)) {}
         
         lambertian(shared_ptr<texture> tex) : tex(tex) {}
 
-        bool scatter(const ray& r_in, const hit_record& rec, color& att, ray& scattered)
-        const override {
-            auto scatter_dir = rec.normal + random_unit_vector();
-
-            if (scatter_dir.near_zero())
-                scatter_dir = rec.normal;
+        // Cosine-weighted, so f / pdf is just the albedo.
+        bool sample(const ray& r_in, const hit_record& rec, bsdf_sample& s) const override {
+            onb uvw(rec.normal);
+            s.direction = uvw.transform(random_cosine_direction());
+            s.pdf = pdf(r_in, rec, s.direction);
+            if (s.pdf <= 0)
+                return false;
 
-            scattered = ray(rec.p, scatter_dir, r_in.time());
-            att = tex->value(rec.u, rec.v, rec.p);
+            s.f = s.pdf * tex->filtered_value(rec.u, rec.v, rec.p, rec.footprint);
+            s.specular = false;
             return true;
         }
+
+        color eval(const ray& r_in, const hit_record& rec, const vec3& direction) const override {
+            return pdf(r_in, rec, direction) * tex->filtered_value(rec.u, rec.v, rec.p, rec.footprint);
+        }
+
+        double pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const override {
+            auto cos_theta = dot(rec.normal, unit_vector(direction));
+            return cos_theta < 0 ? 0 : cos_theta/pi;
+        }
+
+        color base_color(const hit_record& rec) const override { return tex->filtered_value(rec.u, rec.v, rec.p, rec.footprint); }
     
     private:
         shared_ptr<texture> tex;
 };
 
+// A mirror for fuzz 0. Otherwise the reflection is spread over a normalized
+// Phong lobe around the mirror direction, whose exponent 2/fuzz^2 - 2 gives
+// about the blur the original random offset of length fuzz did. The lobe is
+// sampled exactly, so f / pdf is the albedo; directions below the surface are
+// absorbed.
 class metal : public material {
     public:
-        metal(const color& albedo, double fuzz) : albedo(albedo), fuzz(fuzz < 1 ? fuzz : 1) {}
-
-        bool scatter(const ray& r_in, const hit_record& rec, color& att, ray& scattered)
-        const override {
-            vec3 reflected = reflect(r_in.direction(), rec.normal);
-            reflected = unit_vector(reflected) + (fuzz * random_unit_vector());
-            scattered = ray(rec.p, reflected, r_in.time());
-            att = albedo;
-            return (dot(scattered.direction(), rec.normal) > 0);
+        metal(const color& albedo, double fuzz)
+          : albedo(albedo), fuzz(fuzz < 1 ? fuzz : 1),
+            exponent(fuzz > 0 ? 2 / (this->fuzz * this->fuzz) - 2 : 0) {}
+
+        bool sample(const ray& r_in, const hit_record& rec, bsdf_sample& s) const override {
+            vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
+
+            if (fuzz <= 0) {
+                s.direction = reflected;
+                s.f = albedo;
+                s.pdf = 1;
+                s.specular = true;
+                return true;
+            }
+
+            auto u = sample_2d();
+            auto cos_alpha = std::pow(u.u, 1 / (exponent + 1));
+            auto sin_alpha = std::sqrt(std::fmax(0.0, 1 - cos_alpha*cos_alpha));
+            auto phi = 2*pi*u.v;
+
+            onb uvw(reflected);
+            s.direction = uvw.transform(vec3(std::cos(phi)*sin_alpha, std::sin(phi)*sin_alpha, cos_alpha));
+            if (dot(s.direction, rec.normal) <= 0)
+                return false;
+
+            s.pdf = lobe(reflected, s.direction);
+            s.f = s.pdf * albedo;
+            s.specular = false;
+            return true;
         }
+
+        color eval(const ray& r_in, const hit_record& rec, const vec3& direction) const override {
+            if (fuzz <= 0 || dot(direction, rec.normal) <= 0)
+                return color(0,0,0);
+            return pdf(r_in, rec, direction) * albedo;
+        }
+
+        double pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const override {
+            if (fuzz <= 0)
+                return 0;
+            return lobe(reflect(unit_vector(r_in.direction()), rec.normal), direction);
+        }
+
+        color base_color(const hit_record& rec) const override { return albedo; }
     
     private:
         color albedo;
         double fuzz;
+        double exponent;
+
+        double lobe(const vec3& reflected, const vec3& direction) const {
+            auto cos_alpha = dot(reflected, unit_vector(direction));
+            return cos_alpha <= 0 ? 0 : (exponent + 1) / (2*pi) * std::pow(cos_alpha, exponent);
+        }
 };
 
+// Reflects or refracts in proportion to the Fresnel reflectance, so either
+// choice has weight 1.
 class dielectric: public material {
     public:
 
         dielectric(double refraction_index) : refraction_index(refraction_index) {}
 
-        bool scatter(const ray& r_in, const hit_record& rec, color& att, ray& scattered)
-
-        const override {
-            att = color(1.0, 1.0, 1.0);
+        bool sample(const ray& r_in, const hit_record& rec, bsdf_sample& s) const override {
             double ri = rec.front_face ? (1.0/refraction_index) : refraction_index;
 
             vec3 unit_dir = unit_vector(r_in.direction());
@@ -80,15 +164,14 @@ class dielectric: public material {
 
             bool cannot_refract = ri * sin_theta > 1.0;
 
-            vec3 direction;
-
-            if (cannot_refract || reflectance(cos_theta, ri) > random_double())
-                direction = reflect(unit_dir, rec.normal);
+            if (cannot_refract || reflectance(cos_theta, ri) > sample_1d())
+                s.direction = reflect(unit_dir, rec.normal);
             else
-                direction = refract(unit_dir, rec.normal, ri);
-
-            scattered = ray(rec.p, direction, r_in.time());
+                s.direction = refract(unit_dir, rec.normal, ri);
 
+            s.f = color(1.0, 1.0, 1.0);
+            s.pdf = 1;
+            s.specular = true;
             return true;
         }
     private:
@@ -108,28 +191,43 @@ class dielectric: public material {
 class diffuse_light : public material {
   public:
     diffuse_light(shared_ptr<texture> tex) : tex(tex) {}
-    diffuse_light(const color& emit) : tex(make_shared<solid_color>(emit)) {}
+    diffuse_light(const color& emit) : tex(make_scene_object<solid_color>(emit)) {}
 
     color emitted(double u, double v, const point3& p) const override {
         return tex->value(u, v, p);
     }
 
+    bool is_emissive() const override { return true; }
+
   private:
     shared_ptr<texture> tex;
 };
 
+// The phase function of constant_medium: scatters uniformly over the sphere.
+// There is no cosine term inside a medium.
 class isotropic : public material {
   public:
-    isotropic(const color& albedo) : tex(make_shared<solid_color>(albedo)) {}
+    isotropic(const color& albedo) : tex(make_scene_object<solid_color>(albedo)) {}
     isotropic(shared_ptr<texture> tex) : tex(tex) {}
 
-    bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered)
-    const override {
-        scattered = ray(rec.p, random_unit_vector(), r_in.time());
-        attenuation = tex->value(rec.u, rec.v, rec.p);
+    bool sample(const ray& r_in, const hit_record& rec, bsdf_sample& s) const override {
+        s.direction = random_unit_vector();
+        s.pdf = 1 / (4 * pi);
+        s.f = s.pdf * tex->filtered_value(rec.u, rec.v, rec.p, rec.footprint);
+        s.specular = false;
         return true;
     }
 
+    color eval(const ray& r_in, const hit_record& rec, const vec3& direction) const override {
+        return tex->filtered_value(rec.u, rec.v, rec.p, rec.footprint) / (4 * pi);
+    }
+
+    double pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const override {
+        return 1 / (4 * pi);
+    }
+
+    color base_color(const hit_record& rec) const override { return tex->filtered_value(rec.u, rec.v, rec.p, rec.footprint); }
+
   private:
     shared_ptr<texture> tex;
 };
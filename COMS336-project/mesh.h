@@ -1,88 +1,344 @@
 #ifndef MESH_H
 #define MESH_H
 
+#include "asset_cache.h"
+#include "bvh.h"
 #include "canbehit.h"
+#include "mesh_cache.h"
+#include "obj_loader.h"
 #include "triangle.h"
-#include <fstream>
-#include <sstream>
+#include <chrono>
 #include <vector>
 
+// How a mesh stores its faces for intersection. Packets copy every face into
+// SIMD triangle packets, which is fastest. Indexed keeps only the shared vertex
+// buffer and the index buffer and reads the corners through the indices, which
+// uses a fraction of the memory for very large meshes.
+enum class mesh_layout { packets, indexed };
+
 class mesh : public canbehit {
 public:
-    mesh(const std::string& filename, shared_ptr<material> mat) {
-        std::vector<point3> vertices;
-        std::ifstream file(filename);
-        
-        if (!file.is_open()) {
+    // Uses the binary cache next to the OBJ file when it is up to date, and
+    // otherwise parses the file, builds the hierarchy and writes a new cache.
+    mesh(const std::string& filename, shared_ptr<material> mat, mesh_layout layout = mesh_layout::packets)
+      : mat(mat), layout(layout)
+    {
+        if (load_cache(filename))
+            return;
+
+        if (!obj_loader::load(filename, geometry)) {
             std::cerr << "ERROR: Could not open file: " << filename << std::endl;
             return;
         }
 
-        std::string line;
-        while (std::getline(file, line)) {
-            std::istringstream iss(line);
-            std::string type;
-            iss >> type;
+        attach_geometry();
+        build();
 
-            if (type == "v") {
-                double x, y, z;
-                iss >> x >> y >> z;
-                vertices.push_back(point3(x, y, z));
-            }
-            else if (type == "f") {  // Face
-                std::string v1, v2, v3;
-                iss >> v1 >> v2 >> v3;
-                
-                // Extract vertex indices (handling both 'v' and 'v/vt/vn' formats)
-                int idx1 = std::stoi(v1.substr(0, v1.find("/"))) - 1;
-                int idx2 = std::stoi(v2.substr(0, v2.find("/"))) - 1;
-                int idx3 = std::stoi(v3.substr(0, v3.find("/"))) - 1;
-
-                if (idx1 >= 0 && idx2 >= 0 && idx3 >= 0 &&
-                    idx1 < vertices.size() && idx2 < vertices.size() && idx3 < vertices.size()) {
-                    triangles.push_back(make_shared<triangle>(
-                        vertices[idx1],
-                        vertices[idx2],
-                        vertices[idx3],
-                        mat
-                    ));
-                }
-            }
+        if (!save_cache(filename))
+            std::clog << "Mesh: could not write " << mesh_cache::path_for(filename) << '\n';
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        uint32_t face = obj_data::no_index;
+        double t, u, v;
+
+        if (layout == mesh_layout::packets) {
+            tree.traverse(r, ray_t, [&](uint32_t index, interval& span) {
+                int lane;
+                if (!packets[index].hit(r, span, lane, t, u, v))
+                    return false;
+
+                span.max = t;
+                face = packets[index].id[lane];
+                return true;
+            });
+        } else {
+            tree.traverse(r, ray_t, [&](uint32_t index, interval& span) {
+                double face_t, face_u, face_v;
+                if (!hit_face(r, span, index, face_t, face_u, face_v))
+                    return false;
+
+                span.max = t = face_t;
+                u = face_u;
+                v = face_v;
+                face = index;
+                return true;
+            });
         }
 
-        set_bounding_box();
+        if (face == obj_data::no_index)
+            return false;
+
+        rec.set_hit(t, this, face);
+        rec.u = u;
+        rec.v = v;
+        return true;
     }
 
-    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-        hit_record temp_rec;
-        bool hit_anything = false;
-        auto closest_so_far = ray_t.max;
-
-        for (const auto& tri : triangles) {
-            if (tri->hit(r, interval(ray_t.min, closest_so_far), temp_rec)) {
-                hit_anything = true;
-                closest_so_far = temp_rec.t;
-                rec = temp_rec;
-            }
+    void compute_interaction(const ray& r, hit_record& rec) const override {
+        auto face = rec.primitive;
+        auto u = rec.u, v = rec.v;
+
+        auto v0 = corner(face, 0);
+        auto edge1 = corner(face, 1) - v0, edge2 = corner(face, 2) - v0;
+        auto geometric_normal = unit_vector(cross(edge1, edge2));
+        rec.dpdu = edge1;
+        rec.dpdv = edge2;
+
+        rec.p = r.at(rec.t);
+        rec.mat = mat.get();
+        rec.set_face_normal(r, geometric_normal);
+
+        // Interpolate the file's vertex normals and texture coordinates where
+        // the face has them. The shading normal is kept on the side of the
+        // geometric one that faces the ray.
+        double w = 1 - u - v;
+        if (!normal_indices.empty() && has_all(&normal_indices[3*face])) {
+            const uint32_t* normal_index = &normal_indices[3*face];
+            auto shading_normal = unit_vector(w*normal(normal_index[0]) + u*normal(normal_index[1])
+                                            + v*normal(normal_index[2]));
+            rec.normal = dot(shading_normal, rec.normal) < 0 ? -shading_normal : shading_normal;
         }
 
-        return hit_anything;
+        if (!texcoord_indices.empty() && has_all(&texcoord_indices[3*face])) {
+            const uint32_t* texcoord_index = &texcoord_indices[3*face];
+            const float* uv[3];
+            for (int k = 0; k < 3; k++)
+                uv[k] = &texcoords[2*texcoord_index[k]];
+            rec.u = w*uv[0][0] + u*uv[1][0] + v*uv[2][0];
+            rec.v = w*uv[0][1] + u*uv[1][1] + v*uv[2][1];
+
+            // The edges are known in both spaces, which gives the point's
+            // derivatives along the texture coordinates.
+            double du1 = uv[1][0] - uv[0][0], dv1 = uv[1][1] - uv[0][1];
+            double du2 = uv[2][0] - uv[0][0], dv2 = uv[2][1] - uv[0][1];
+            double det = du1*dv2 - dv1*du2;
+            if (std::fabs(det) > 1e-12) {
+                rec.dpdu = (dv2*edge1 - dv1*edge2) / det;
+                rec.dpdv = (du1*edge2 - du2*edge1) / det;
+            } else {
+                rec.dpdu = rec.dpdv = vec3(0, 0, 0);
+            }
+        }
     }
 
     aabb bounding_box() const override { return bbox; }
 
+    size_t object_count() const override { return position_indices.size / 3; }
+
 private:
-    std::vector<shared_ptr<triangle>> triangles;
+    typedef triangle_packet<triangle_packet_width> packet;
+
+    // The mesh keeps its own wide hierarchy over its faces, whose leaves are
+    // triangle packets or runs of faces, so a ray that enters the mesh bounds
+    // only tests the faces along its path. One material serves the whole mesh.
+    wide_bvh<triangle_packet_width> tree;
+    shared_ptr<material> mat;
+    mesh_layout layout;
     aabb bbox;
 
-    void set_bounding_box() {
-        if (triangles.empty()) return;
+    // The buffers are read through views, which point either into the data
+    // built here or into the mapped cache file.
+    obj_data geometry;
+    std::vector<packet> built_packets;
+    mesh_cache cache;
+
+    buffer_view<float> positions, normals, texcoords;
+    buffer_view<uint32_t> position_indices, normal_indices, texcoord_indices;
+    buffer_view<packet> packets;
+
+    point3 position(uint32_t index) const {
+        const float* p = &positions[3*index];
+        return point3(p[0], p[1], p[2]);
+    }
+
+    vec3 normal(uint32_t index) const {
+        const float* n = &normals[3*index];
+        return vec3(n[0], n[1], n[2]);
+    }
+
+    static bool has_all(const uint32_t* index) {
+        return index[0] != obj_data::no_index && index[1] != obj_data::no_index
+            && index[2] != obj_data::no_index;
+    }
+
+    point3 corner(size_t face, int k) const {
+        return position(position_indices[3*face + k]);
+    }
+
+    // Möller–Trumbore against one face, reading its corners through the index buffer.
+    bool hit_face(const ray& r, const interval& ray_t, uint32_t face, double& t, double& u, double& v) const {
+        auto v0 = corner(face, 0);
+        auto edge1 = corner(face, 1) - v0;
+        auto edge2 = corner(face, 2) - v0;
 
-        bbox = triangles[0]->bounding_box();
-        for (const auto& tri : triangles) {
-            bbox = aabb(bbox, tri->bounding_box());
+        auto h = cross(r.direction(), edge2);
+        auto a = dot(edge1, h);
+        if (a > -1e-8 && a < 1e-8)
+            return false;
+
+        auto f = 1.0/a;
+        auto s = r.origin() - v0;
+        u = f * dot(s, h);
+        if (u < 0.0 || u > 1.0)
+            return false;
+
+        auto q = cross(s, edge1);
+        v = f * dot(r.direction(), q);
+        if (v < 0.0 || u + v > 1.0)
+            return false;
+
+        t = f * dot(edge2, q);
+        return ray_t.contains(t);
+    }
+
+    // Packet width for the packet layout, 0 for the indexed one. The cache
+    // records it, since the two layouts store different leaves.
+    uint32_t leaf_format() const {
+        return layout == mesh_layout::packets ? triangle_packet_width : 0;
+    }
+
+    size_t memory_bytes() const {
+        return positions.size * sizeof(float) + normals.size * sizeof(float)
+             + texcoords.size * sizeof(float)
+             + (position_indices.size + normal_indices.size + texcoord_indices.size) * sizeof(uint32_t)
+             + tree.node_view().size * sizeof(wide_bvh_node<triangle_packet_width>)
+             + packets.size * sizeof(packet);
+    }
+
+    void build() {
+        size_t face_count = geometry.triangle_count();
+        if (face_count == 0)
+            return;
+
+        std::vector<aabb> boxes;
+        boxes.reserve(face_count);
+        bbox = aabb::empty;
+        for (size_t i = 0; i < face_count; i++) {
+            boxes.push_back(aabb(aabb(corner(i, 0), corner(i, 1)), aabb(corner(i, 2), corner(i, 2))));
+            bbox = aabb(bbox, boxes.back());
+        }
+
+        linear_bvh binary;
+        auto order = binary.build(boxes);
+
+        // Store the faces in leaf order, so every leaf covers a contiguous run
+        // of the index buffers.
+        permute_faces(geometry.position_indices, order);
+        permute_faces(geometry.normal_indices, order);
+        permute_faces(geometry.texcoord_indices, order);
+        attach_geometry();
+
+        tree.collapse(binary, triangle_packet_width);
+
+        if (layout == mesh_layout::packets) {
+            // Turn every leaf slot into one packet holding its faces.
+            for (auto& node : tree.nodes) {
+                for (int slot = 0; slot < triangle_packet_width; slot++) {
+                    if (node.count[slot] == 0)
+                        continue;
+
+                    packet p;
+                    for (int lane = 0; lane < node.count[slot]; lane++) {
+                        auto face = node.offset[slot] + lane;
+                        p.set(lane, corner(face, 0), corner(face, 1), corner(face, 2), face);
+                    }
+
+                    node.offset[slot] = uint32_t(built_packets.size());
+                    node.count[slot] = 1;
+                    built_packets.push_back(p);
+                }
+            }
+
+            packets = built_packets;
+        }
+
+        std::clog << "Mesh: " << face_count << " triangles, " << tree.nodes.size() << " BVH"
+                  << triangle_packet_width << " nodes, " << packets.size << " packets, "
+                  << double(memory_bytes()) / face_count << " bytes per triangle, SAH cost "
+                  << binary.sah_cost() << '\n';
+    }
+
+    static void permute_faces(std::vector<uint32_t>& indices, const std::vector<uint32_t>& order) {
+        if (indices.empty())
+            return;
+
+        std::vector<uint32_t> sorted(indices.size());
+        for (size_t i = 0; i < order.size(); i++) {
+            for (int k = 0; k < 3; k++)
+                sorted[3*i + k] = indices[3*order[i] + k];
         }
+        indices.swap(sorted);
+    }
+
+    void attach_geometry() {
+        positions = geometry.positions;
+        normals = geometry.normals;
+        texcoords = geometry.texcoords;
+        position_indices = geometry.position_indices;
+        normal_indices = geometry.normal_indices;
+        texcoord_indices = geometry.texcoord_indices;
+    }
+
+    bool load_cache(const std::string& filename) {
+        auto start_time = std::chrono::steady_clock::now();
+
+        if (!cache.open(filename, leaf_format()))
+            return false;
+
+        buffer_view<wide_bvh_node<triangle_packet_width>> nodes;
+        bool complete = cache.get(mesh_cache::positions, positions)
+                     && cache.get(mesh_cache::normals, normals)
+                     && cache.get(mesh_cache::texcoords, texcoords)
+                     && cache.get(mesh_cache::position_indices, position_indices)
+                     && cache.get(mesh_cache::normal_indices, normal_indices)
+                     && cache.get(mesh_cache::texcoord_indices, texcoord_indices)
+                     && cache.get(mesh_cache::bvh_nodes, nodes)
+                     && cache.get(mesh_cache::triangle_packets, packets);
+        if (!complete)
+            return false;
+
+        tree.attach(nodes);
+        bbox = cache.bounds();
+
+        auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+        std::clog << "Mesh: " << position_indices.size / 3 << " triangles, " << packets.size
+                  << " packets from " << mesh_cache::path_for(filename) << " in "
+                  << 1000 * seconds << " ms\n";
+        return true;
+    }
+
+    bool save_cache(const std::string& filename) const {
+        if (position_indices.empty())
+            return true;
+
+        const mesh_cache::raw_section sections[mesh_cache::section_count] = {
+            mesh_cache::raw(positions),
+            mesh_cache::raw(normals),
+            mesh_cache::raw(texcoords),
+            mesh_cache::raw(position_indices),
+            mesh_cache::raw(normal_indices),
+            mesh_cache::raw(texcoord_indices),
+            mesh_cache::raw(tree.node_view()),
+            mesh_cache::raw(packets)
+        };
+        return mesh_cache::write(filename, leaf_format(), bbox, sections);
     }
 };
 
-#endif
\ No newline at end of file
+// Makes a mesh through the current asset cache. Every scene that loads the same
+// file with the same layout shares one copy of its buffers and hierarchy, and
+// gets its own material on top.
+inline shared_ptr<canbehit> load_mesh(const std::string& filename, shared_ptr<material> mat,
+                                      mesh_layout layout = mesh_layout::packets) {
+    if (!asset_cache::current())
+        return make_scene_object<mesh>(filename, mat, layout);
+
+    auto key = filename + (layout == mesh_layout::packets ? "#packets" : "#indexed");
+    auto shape = cached_asset<mesh>(key, [&] {
+        return std::make_shared<mesh>(filename, nullptr, layout);
+    });
+    return make_scene_object<with_material>(shape, mat);
+}
+
+#endif
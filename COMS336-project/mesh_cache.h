@@ -0,0 +1,184 @@
+#ifndef MESH_CACHE_H
+#define MESH_CACHE_H
+
+#include "aabb.h"
+#include "buffer_view.h"
+#include "mapped_file.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+
+// A binary copy of a mesh's buffers and acceleration structure, written next to
+// its OBJ file as "<file>.cache". Every section starts on a 64-byte boundary, so
+// a mapping of the file can be used in place without parsing or copying.
+class mesh_cache {
+  public:
+    enum section {
+        positions, normals, texcoords,
+        position_indices, normal_indices, texcoord_indices,
+        bvh_nodes, triangle_packets,
+        section_count
+    };
+
+    // Raised whenever the layout of a section or of the header changes.
+    static const uint32_t version = 2;
+
+    struct raw_section {
+        const void* data = nullptr;
+        uint64_t    count = 0;
+        uint64_t    element_size = 0;
+    };
+
+    template <typename T>
+    static raw_section raw(buffer_view<T> view) {
+        raw_section s;
+        s.data = view.data;
+        s.count = view.size;
+        s.element_size = sizeof(T);
+        return s;
+    }
+
+    static std::string path_for(const std::string& source) { return source + ".cache"; }
+
+    // Maps the cache of the given OBJ file. Fails if there is none, or if it was
+    // written for another version, leaf format or state of the source file.
+    bool open(const std::string& source, uint32_t leaf_format) {
+        file.close();
+
+        uint64_t source_size;
+        int64_t source_time;
+        if (!stamp(source, source_size, source_time) || !file.open(path_for(source)))
+            return false;
+
+        if (file.size() < sizeof(header)) {
+            file.close();
+            return false;
+        }
+
+        std::memcpy(&head, file.data(), sizeof(header));
+        bool valid = std::memcmp(head.magic, magic, sizeof(head.magic)) == 0
+                  && head.version == version
+                  && head.leaf_format == leaf_format
+                  && head.source_size == source_size
+                  && head.source_time == source_time;
+
+        for (int i = 0; valid && i < section_count; i++) {
+            auto& s = head.sections[i];
+            valid = s.offset % alignment == 0 && s.offset <= file.size()
+                 && s.count * s.element_size <= file.size() - s.offset;
+        }
+
+        if (!valid)
+            file.close();
+        return valid;
+    }
+
+    bool valid() const { return file.valid(); }
+
+    aabb bounds() const {
+        return aabb(point3(head.bounds_min[0], head.bounds_min[1], head.bounds_min[2]),
+                    point3(head.bounds_max[0], head.bounds_max[1], head.bounds_max[2]));
+    }
+
+    // Returns false if the stored elements are not the size of a T.
+    template <typename T>
+    bool get(section which, buffer_view<T>& view) const {
+        const auto& s = head.sections[which];
+        if (s.element_size != sizeof(T) && s.count > 0)
+            return false;
+
+        view = buffer_view<T>(reinterpret_cast<const T*>(file.data() + s.offset), size_t(s.count));
+        return true;
+    }
+
+    // Writes a new cache for the source file. The file is written under a
+    // temporary name and renamed, so other runs never map a half-written cache.
+    static bool write(const std::string& source, uint32_t leaf_format, const aabb& bbox,
+                      const raw_section (&sections)[section_count]) {
+        header h;
+        std::memcpy(h.magic, magic, sizeof(h.magic));
+        h.version = version;
+        h.leaf_format = leaf_format;
+        if (!stamp(source, h.source_size, h.source_time))
+            return false;
+
+        for (int axis = 0; axis < 3; axis++) {
+            h.bounds_min[axis] = bbox.axis_interval(axis).min;
+            h.bounds_max[axis] = bbox.axis_interval(axis).max;
+        }
+
+        uint64_t offset = align(sizeof(header));
+        for (int i = 0; i < section_count; i++) {
+            h.sections[i].offset = offset;
+            h.sections[i].count = sections[i].count;
+            h.sections[i].element_size = sections[i].element_size;
+            offset = align(offset + sections[i].count * sections[i].element_size);
+        }
+
+        auto target = path_for(source);
+        auto temporary = target + ".tmp";
+        {
+            std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+            if (!out)
+                return false;
+
+            static const char padding[alignment] = {};
+            out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+            out.write(padding, std::streamsize(h.sections[0].offset - sizeof(h)));
+
+            for (int i = 0; i < section_count; i++) {
+                auto bytes = sections[i].count * sections[i].element_size;
+                out.write(static_cast<const char*>(sections[i].data), std::streamsize(bytes));
+                out.write(padding, std::streamsize(align(bytes) - bytes));
+            }
+
+            if (!out)
+                return false;
+        }
+
+        std::remove(target.c_str());
+        return std::rename(temporary.c_str(), target.c_str()) == 0;
+    }
+
+  private:
+    static const size_t alignment = 64;
+    static constexpr char magic[8] = {'R', 'T', 'M', 'E', 'S', 'H', 0, 0};
+
+    struct section_entry {
+        uint64_t offset;
+        uint64_t count;
+        uint64_t element_size;
+    };
+
+    struct header {
+        char          magic[8];
+        uint32_t      version;
+        uint32_t      leaf_format;  // Set by the mesh, which knows what its leaves hold
+        uint64_t      source_size;  // Size and modification time of the OBJ file
+        int64_t       source_time;  // the cache was built from
+        double        bounds_min[3];
+        double        bounds_max[3];
+        section_entry sections[section_count];
+    };
+
+    mapped_file file;
+    header head;
+
+    static uint64_t align(uint64_t offset) { return (offset + alignment - 1) / alignment * alignment; }
+
+    static bool stamp(const std::string& source, uint64_t& size, int64_t& time) {
+        std::error_code error;
+        size = std::filesystem::file_size(source, error);
+        if (error)
+            return false;
+
+        time = int64_t(std::filesystem::last_write_time(source, error).time_since_epoch().count());
+        return !error;
+    }
+};
+
+#endif
@@ -0,0 +1,367 @@
+#ifndef OBJ_LOADER_H
+#define OBJ_LOADER_H
+
+#include "mapped_file.h"
+#include "thread_pool.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Geometry read from a Wavefront OBJ file. Polygons are fan-triangulated, and
+// each index buffer holds three entries per triangle.
+struct obj_data {
+    static const uint32_t no_index = 0xffffffff;
+
+    std::vector<float> positions;  // x, y, z per vertex
+    std::vector<float> normals;    // x, y, z per vertex normal
+    std::vector<float> texcoords;  // u, v per texture coordinate
+
+    std::vector<uint32_t> position_indices;
+    std::vector<uint32_t> normal_indices;    // no_index where a corner has no normal,
+    std::vector<uint32_t> texcoord_indices;  // empty if no corner has one
+
+    size_t triangle_count() const { return position_indices.size() / 3; }
+};
+
+// Memory-maps an OBJ file and parses it in parallel by line ranges. Numbers are
+// read by a small locale-independent parser instead of iostreams.
+class obj_loader {
+  public:
+    static bool load(const std::string& filename, obj_data& out, thread_pool& pool = thread_pool::shared()) {
+        auto start_time = std::chrono::steady_clock::now();
+
+        mapped_file file(filename);
+        if (!file.valid())
+            return false;
+
+        const char* text = file.data();
+        size_t size = file.size();
+
+        // Split the file into chunks that start at the beginning of a line.
+        const size_t min_chunk_bytes = 256 * 1024;
+        size_t chunk_count = std::max<size_t>(1, std::min<size_t>(size / min_chunk_bytes, 8 * pool.size()));
+
+        std::vector<size_t> bounds(chunk_count + 1, size);
+        bounds[0] = 0;
+        for (size_t i = 1; i < chunk_count; i++) {
+            size_t p = std::max(bounds[i-1], size * i / chunk_count);
+            while (p < size && text[p-1] != '\n')
+                p++;
+            bounds[i] = p;
+        }
+
+        std::vector<chunk> chunks(chunk_count);
+        pool.parallel_for(int(chunk_count), [&](int i) {
+            parse_chunk(text + bounds[i], text + bounds[i+1], chunks[i]);
+        });
+
+        merge(chunks, out, pool);
+
+        auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+        auto megabytes = size / (1024.0 * 1024.0);
+        std::clog << "OBJ: " << filename << ": " << out.positions.size() / 3 << " vertices, "
+                  << out.triangle_count() << " triangles, " << megabytes << " MB in "
+                  << 1000 * seconds << " ms (" << (seconds > 0 ? megabytes / seconds : 0)
+                  << " MB/s)\n";
+
+        return true;
+    }
+
+  private:
+    // Negative (relative) OBJ indices are resolved against the chunk's own
+    // element counts while parsing; the corners listed in relative still need
+    // the number of elements that earlier chunks declared.
+    struct chunk {
+        std::vector<float> positions, normals, texcoords;
+        std::vector<int64_t> corners;  // Position, texcoord, normal per triangle corner
+        std::vector<size_t> relative[3];
+    };
+
+    static const int64_t missing = INT64_MIN;
+
+    static bool is_space(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+    static bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+    static const char* skip_spaces(const char* p, const char* end) {
+        while (p < end && is_space(*p))
+            p++;
+        return p;
+    }
+
+    static const char* parse_int(const char* p, const char* end, int64_t& value) {
+        bool negative = false;
+        if (p < end && (*p == '-' || *p == '+')) {
+            negative = *p == '-';
+            p++;
+        }
+
+        const char* digits = p;
+        int64_t result = 0;
+        while (p < end && is_digit(*p))
+            result = result * 10 + (*p++ - '0');
+
+        if (p == digits)
+            return nullptr;
+
+        value = negative ? -result : result;
+        return p;
+    }
+
+    static const char* parse_float(const char* p, const char* end, float& value) {
+        static const double powers_of_ten[] = {
+            1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+        };
+
+        bool negative = false;
+        if (p < end && (*p == '-' || *p == '+')) {
+            negative = *p == '-';
+            p++;
+        }
+
+        uint64_t mantissa = 0;
+        int exponent = 0;
+        int digit_count = 0;
+        bool any_digits = false;
+
+        // Digits past the 19th no longer fit the mantissa and only move the exponent.
+        for (; p < end && is_digit(*p); p++, any_digits = true) {
+            if (digit_count < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                if (mantissa) digit_count++;
+            } else {
+                exponent++;
+            }
+        }
+
+        if (p < end && *p == '.') {
+            for (p++; p < end && is_digit(*p); p++, any_digits = true) {
+                if (digit_count < 19) {
+                    mantissa = mantissa * 10 + (*p - '0');
+                    if (mantissa) digit_count++;
+                    exponent--;
+                }
+            }
+        }
+
+        if (!any_digits)
+            return nullptr;
+
+        if (p < end && (*p == 'e' || *p == 'E')) {
+            int64_t e;
+            const char* after = parse_int(p + 1, end, e);
+            if (after) {
+                exponent += int(e);
+                p = after;
+            }
+        }
+
+        double result = double(mantissa);
+        if (exponent < 0 && exponent >= -22)
+            result /= powers_of_ten[-exponent];
+        else if (exponent > 0 && exponent <= 22)
+            result *= powers_of_ten[exponent];
+        else if (exponent != 0)
+            result *= std::pow(10.0, exponent);
+
+        value = float(negative ? -result : result);
+        return p;
+    }
+
+    static const char* parse_floats(const char* p, const char* end, int count, std::vector<float>& out) {
+        for (int i = 0; i < count; i++) {
+            float value = 0;
+            p = skip_spaces(p, end);
+            const char* after = parse_float(p, end, value);
+            if (after) p = after;
+            out.push_back(value);
+        }
+        return p;
+    }
+
+    // Reads one "v", "v/vt", "v//vn" or "v/vt/vn" face corner.
+    static const char* parse_corner(const char* p, const char* end, int64_t corner[3]) {
+        corner[0] = corner[1] = corner[2] = missing;
+
+        p = parse_int(p, end, corner[0]);
+        if (!p)
+            return nullptr;
+
+        for (int attribute = 1; attribute < 3 && p < end && *p == '/'; attribute++) {
+            p++;
+            int64_t value;
+            const char* after = parse_int(p, end, value);
+            if (after) {
+                corner[attribute] = value;
+                p = after;
+            }
+        }
+
+        return p;
+    }
+
+    struct face_corner {
+        int64_t index[3];    // Position, texcoord, normal
+        bool    relative[3];
+    };
+
+    static void parse_chunk(const char* p, const char* end, chunk& out) {
+        std::vector<face_corner> polygon;
+
+        while (p < end) {
+            p = skip_spaces(p, end);
+            const char* line = p;
+
+            if (p + 1 < end && line[0] == 'v' && is_space(line[1])) {
+                p = parse_floats(p + 2, end, 3, out.positions);
+            } else if (p + 2 < end && line[0] == 'v' && line[1] == 'n' && is_space(line[2])) {
+                p = parse_floats(p + 3, end, 3, out.normals);
+            } else if (p + 2 < end && line[0] == 'v' && line[1] == 't' && is_space(line[2])) {
+                p = parse_floats(p + 3, end, 2, out.texcoords);
+            } else if (p + 1 < end && line[0] == 'f' && is_space(line[1])) {
+                const int64_t counts[3] = {
+                    int64_t(out.positions.size() / 3),
+                    int64_t(out.texcoords.size() / 2),
+                    int64_t(out.normals.size() / 3)
+                };
+
+                polygon.clear();
+                p += 2;
+
+                while (true) {
+                    p = skip_spaces(p, end);
+                    if (p == end || *p == '\n')
+                        break;
+
+                    face_corner corner;
+                    const char* after = parse_corner(p, end, corner.index);
+                    if (!after)
+                        break;
+                    p = after;
+
+                    // OBJ indices start at 1, and negative ones count back from
+                    // the latest element; both become 0-based here.
+                    for (int attribute = 0; attribute < 3; attribute++) {
+                        auto& index = corner.index[attribute];
+                        corner.relative[attribute] = index != missing && index < 0;
+                        if (index == missing || index == 0)
+                            index = missing;
+                        else if (index > 0)
+                            index -= 1;
+                        else
+                            index += counts[attribute];
+                    }
+                    polygon.push_back(corner);
+                }
+
+                // Fan-triangulate polygons with more than three corners.
+                for (size_t i = 1; i + 1 < polygon.size(); i++) {
+                    for (auto k : {size_t(0), i, i + 1}) {
+                        for (int attribute = 0; attribute < 3; attribute++) {
+                            if (polygon[k].relative[attribute])
+                                out.relative[attribute].push_back(out.corners.size());
+                            out.corners.push_back(polygon[k].index[attribute]);
+                        }
+                    }
+                }
+            }
+
+            while (p < end && *p != '\n')
+                p++;
+            if (p < end)
+                p++;
+        }
+    }
+
+    static void merge(std::vector<chunk>& chunks, obj_data& out, thread_pool& pool) {
+        size_t chunk_count = chunks.size();
+
+        // Prefix sums give every chunk its place in the merged buffers.
+        std::vector<size_t> position_base(chunk_count + 1, 0);
+        std::vector<size_t> normal_base(chunk_count + 1, 0);
+        std::vector<size_t> texcoord_base(chunk_count + 1, 0);
+        std::vector<size_t> corner_base(chunk_count + 1, 0);
+
+        for (size_t i = 0; i < chunk_count; i++) {
+            position_base[i+1] = position_base[i] + chunks[i].positions.size();
+            normal_base[i+1] = normal_base[i] + chunks[i].normals.size();
+            texcoord_base[i+1] = texcoord_base[i] + chunks[i].texcoords.size();
+            corner_base[i+1] = corner_base[i] + chunks[i].corners.size() / 3;
+        }
+
+        out.positions.resize(position_base[chunk_count]);
+        out.normals.resize(normal_base[chunk_count]);
+        out.texcoords.resize(texcoord_base[chunk_count]);
+
+        std::vector<uint32_t> corners(3 * corner_base[chunk_count]);
+        const int64_t limits[3] = {
+            int64_t(out.positions.size() / 3),
+            int64_t(out.texcoords.size() / 2),
+            int64_t(out.normals.size() / 3)
+        };
+
+        pool.parallel_for(int(chunk_count), [&](int i) {
+            auto& c = chunks[i];
+            std::copy(c.positions.begin(), c.positions.end(), out.positions.begin() + position_base[i]);
+            std::copy(c.normals.begin(), c.normals.end(), out.normals.begin() + normal_base[i]);
+            std::copy(c.texcoords.begin(), c.texcoords.end(), out.texcoords.begin() + texcoord_base[i]);
+
+            // Relative indices were resolved against this chunk alone, so they
+            // still need the elements declared by earlier chunks.
+            const int64_t bases[3] = {
+                int64_t(position_base[i] / 3),
+                int64_t(texcoord_base[i] / 2),
+                int64_t(normal_base[i] / 3)
+            };
+            for (int attribute = 0; attribute < 3; attribute++) {
+                for (auto k : c.relative[attribute])
+                    c.corners[k] += bases[attribute];
+            }
+
+            auto* target = &corners[3 * corner_base[i]];
+            for (size_t k = 0; k < c.corners.size(); k++) {
+                int64_t index = c.corners[k];
+                bool valid = index != missing && index >= 0 && index < limits[k % 3];
+                target[k] = valid ? uint32_t(index) : obj_data::no_index;
+            }
+        });
+
+        // Drop triangles with a missing or out-of-range position index and
+        // split the corner triplets into the per-attribute index buffers.
+        size_t corner_total = corners.size() / 3;
+        out.position_indices.clear();
+        out.texcoord_indices.clear();
+        out.normal_indices.clear();
+        out.position_indices.reserve(corner_total);
+        out.texcoord_indices.reserve(corner_total);
+        out.normal_indices.reserve(corner_total);
+
+        bool any_texcoords = false, any_normals = false;
+        for (size_t tri = 0; tri + 2 < corner_total; tri += 3) {
+            const uint32_t* c = &corners[3 * tri];
+            if (c[0] == obj_data::no_index || c[3] == obj_data::no_index || c[6] == obj_data::no_index)
+                continue;
+
+            for (int k = 0; k < 3; k++) {
+                out.position_indices.push_back(c[3*k]);
+                out.texcoord_indices.push_back(c[3*k + 1]);
+                out.normal_indices.push_back(c[3*k + 2]);
+                any_texcoords |= c[3*k + 1] != obj_data::no_index;
+                any_normals |= c[3*k + 2] != obj_data::no_index;
+            }
+        }
+
+        // Files without normals or texture coordinates need no index buffers
+        // for them.
+        if (!any_texcoords)
+            out.texcoord_indices = std::vector<uint32_t>();
+        if (!any_normals)
+            out.normal_indices = std::vector<uint32_t>();
+    }
+};
+
+#endif
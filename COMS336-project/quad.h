@@ -4,6 +4,7 @@
 #include "canbehit.h"
 #include "canbehit_list.h"
 #include "aabb.h"
+#include "material.h"
 
 class quad : public canbehit {
   public:
@@ -14,6 +15,7 @@ class quad : public canbehit {
         normal = unit_vector(n);
         D = dot(normal, Q);
         w = n / dot(n,n);
+        area = n.length();
 
         set_bounding_box();
     }
@@ -44,12 +46,35 @@ class quad : public canbehit {
         if (!is_interior(alpha, beta, rec))
             return false;
 
-        rec.t = t;
-        rec.p = intersection;
-        rec.mat = mat;
+        rec.set_hit(t, this);
+        return true;
+    }
+
+    void compute_interaction(const ray& r, hit_record& rec) const override {
+        rec.p = r.at(rec.t);
+        rec.mat = mat.get();
         rec.set_face_normal(r, normal);
+        rec.dpdu = u;
+        rec.dpdv = v;
+    }
 
-        return true;
+    bool is_emitter() const override { return mat->is_emissive(); }
+
+    double pdf_value(const point3& origin, const vec3& direction, double time) const override {
+        hit_record rec;
+        if (!hit(ray(origin, direction, time), interval(0.001, infinity), rec))
+            return 0;
+
+        auto distance_squared = rec.t * rec.t * direction.length_squared();
+        auto cosine = std::fabs(dot(direction, normal) / direction.length());
+
+        return distance_squared / (cosine * area);
+    }
+
+    vec3 random(const point3& origin, double time) const override {
+        auto s = sample_2d();
+        auto p = Q + (s.u * u) + (s.v * v);
+        return p - origin;
     }
 
     virtual bool is_interior(double a, double b, hit_record& rec) const {
@@ -71,12 +96,13 @@ class quad : public canbehit {
     aabb bbox;
     vec3 normal;
     double D;
+    double area;
 };
 
 inline shared_ptr<canbehit_list> box(const point3& a, const point3& b, shared_ptr<material> mat)
 {
 
-    auto sides = make_shared<canbehit_list>();
+    auto sides = make_scene_object<canbehit_list>();
 
     auto min = point3(std::fmin(a.x(),b.x()), std::fmin(a.y(),b.y()), std::fmin(a.z(),b.z()));
     auto max = point3(std::fmax(a.x(),b.x()), std::fmax(a.y(),b.y()), std::fmax(a.z(),b.z()));
@@ -85,12 +111,12 @@ inline shared_ptr<canbehit_list> box(const point3& a, const point3& b, shared_pt
     auto dy = vec3(0, max.y() - min.y(), 0);
     auto dz = vec3(0, 0, max.z() - min.z());
 
-    sides->add(make_shared<quad>(point3(min.x(), min.y(), max.z()),  dx,  dy, mat));
-    sides->add(make_shared<quad>(point3(max.x(), min.y(), max.z()), -dz,  dy, mat));
-    sides->add(make_shared<quad>(point3(max.x(), min.y(), min.z()), -dx,  dy, mat));
-    sides->add(make_shared<quad>(point3(min.x(), min.y(), min.z()),  dz,  dy, mat));
-    sides->add(make_shared<quad>(point3(min.x(), max.y(), max.z()),  dx, -dz, mat));
-    sides->add(make_shared<quad>(point3(min.x(), min.y(), min.z()),  dx,  dz, mat));
+    sides->add(make_scene_object<quad>(point3(min.x(), min.y(), max.z()),  dx,  dy, mat));
+    sides->add(make_scene_object<quad>(point3(max.x(), min.y(), max.z()), -dz,  dy, mat));
+    sides->add(make_scene_object<quad>(point3(max.x(), min.y(), min.z()), -dx,  dy, mat));
+    sides->add(make_scene_object<quad>(point3(min.x(), min.y(), min.z()),  dz,  dy, mat));
+    sides->add(make_scene_object<quad>(point3(min.x(), max.y(), max.z()),  dx, -dz, mat));
+    sides->add(make_scene_object<quad>(point3(min.x(), min.y(), min.z()),  dx,  dz, mat));
 
     return sides;
 }
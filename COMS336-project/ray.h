@@ -27,4 +27,34 @@ class ray {
         double tm;
 };
 
+// A camera ray together with the rays through the next pixel to the right and
+// the next pixel down. Where the three land tells how much of a surface one
+// pixel covers, and so how blurred a texture lookup should be.
+class ray_differential : public ray {
+    public:
+        bool has_differentials = false;
+        point3 rx_origin, ry_origin;
+        vec3 rx_direction, ry_direction;
+
+        ray_differential() {}
+
+        ray_differential(const ray& r) : ray(r) {}
+
+        // Pulls the neighbouring rays in by s, for when many samples share a
+        // pixel and each only needs to cover its part of it.
+        void scale_differentials(double s) {
+            rx_origin = origin() + (rx_origin - origin()) * s;
+            ry_origin = origin() + (ry_origin - origin()) * s;
+            rx_direction = direction() + (rx_direction - direction()) * s;
+            ry_direction = direction() + (ry_direction - direction()) * s;
+        }
+};
+
+// How far the texture coordinates move from a pixel to the next one to the
+// right (x) and down (y). All zero when the ray had no differentials.
+struct uv_footprint {
+    double dudx = 0, dvdx = 0;
+    double dudy = 0, dvdy = 0;
+};
+
 #endif
\ No newline at end of file
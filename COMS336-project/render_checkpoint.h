@@ -0,0 +1,151 @@
+#ifndef RENDER_CHECKPOINT_H
+#define RENDER_CHECKPOINT_H
+
+#include "mapped_file.h"
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// The per-pixel state of a progressive render (sample sums and counts), kept in
+// a memory-mapped file so the render can be stopped at any time and resumed.
+//
+// The random numbers of a sample depend only on its pixel and sample index, so
+// the sums and the number of samples taken are all the state a resumed render
+// needs. The file holds two copies of the state: a save writes the older copy
+// and only then points the header at it, so a render killed while saving still
+// finds the previous checkpoint intact.
+class render_checkpoint {
+  public:
+    // One of the float buffers that make up the render state.
+    struct region {
+        float* data;
+        size_t count;
+    };
+
+    enum class open_result {
+        started,   // No saved state, or the file could not be opened
+        resumed,   // Saved state was loaded into the regions
+        refused    // The file holds something else and was left alone
+    };
+
+    // Opens the checkpoint for an image, or starts a new one if the file is
+    // missing or empty. A file written for other settings or buffers, or one
+    // that is not a checkpoint, is refused rather than overwritten, so
+    // toggling an output between runs cannot throw away earlier progress.
+    open_result open(const std::string& filename, int width, int height, uint64_t settings,
+                     const std::vector<region>& state) {
+        file.close();
+        path = filename;
+
+        floats = 0;
+        for (const auto& r : state)
+            floats += r.count;
+        size_t size = sizeof(header) + 2 * floats * sizeof(float);
+
+        std::error_code error;
+        auto existing_size = std::filesystem::file_size(filename, error);
+        bool existing = !error && existing_size > 0;
+
+        if (existing) {
+            mapped_file saved(filename);
+            const char* problem = nullptr;
+            if (!saved.valid() || saved.size() < sizeof(header))
+                problem = "is not a render checkpoint";
+            else {
+                const header& h = *reinterpret_cast<const header*>(saved.data());
+                if (std::memcmp(h.magic, magic, sizeof(h.magic)) != 0 || h.active >= 2)
+                    problem = "is not a render checkpoint";
+                else if (h.version != version)
+                    problem = "was written by another version of the renderer";
+                else if (h.width != width || h.height != height || existing_size != size)
+                    problem = "was saved for another image size or other outputs";
+                else if (h.settings != settings)
+                    problem = "was saved for other settings or another scene";
+            }
+
+            if (problem) {
+                std::cerr << "ERROR: Checkpoint " << filename << ' ' << problem
+                          << ". Delete it or choose another checkpoint file." << std::endl;
+                return open_result::refused;
+            }
+        }
+
+        if (!file.open_writable(filename, size)) {
+            std::cerr << "ERROR: Could not open checkpoint: " << filename << std::endl;
+            return open_result::started;
+        }
+
+        auto& h = head();
+        if (existing) {
+            const float* source = slot(h.active);
+            for (const auto& r : state) {
+                std::memcpy(r.data, source, r.count * sizeof(float));
+                source += r.count;
+            }
+            return open_result::resumed;
+        }
+
+        std::memset(&h, 0, sizeof(h));
+        std::memcpy(h.magic, magic, sizeof(h.magic));
+        h.version = version;
+        h.width = width;
+        h.height = height;
+        h.settings = settings;
+        file.flush();
+        return open_result::started;
+    }
+
+    bool valid() const { return file.valid(); }
+
+    // Closes and deletes the file, for a render that has finished.
+    void remove() {
+        file.close();
+        std::error_code error;
+        std::filesystem::remove(path, error);
+    }
+
+    void save(const std::vector<region>& state) {
+        auto& h = head();
+        uint32_t next = h.active ^ 1;
+
+        float* target = slot(next);
+        for (const auto& r : state) {
+            std::memcpy(target, r.data, r.count * sizeof(float));
+            target += r.count;
+        }
+        file.flush();
+
+        h.active = next;
+        file.flush();
+    }
+
+  private:
+    static const uint32_t version = 2;
+    static constexpr char magic[8] = {'R', 'T', 'C', 'K', 'P', 'T', 0, 0};
+
+    struct header {
+        char     magic[8];
+        uint32_t version;
+        int32_t  width;
+        int32_t  height;
+        uint32_t active;      // Slot holding the latest complete save
+        uint64_t settings;    // Hash of the camera settings the state belongs to
+        uint8_t  pad[32];     // Keeps the state 64-byte aligned
+    };
+
+    mapped_file file;
+    std::string path;
+    size_t floats = 0;
+
+    header& head() { return *reinterpret_cast<header*>(file.writable_data()); }
+
+    float* slot(uint32_t index) {
+        return reinterpret_cast<float*>(file.writable_data() + sizeof(header)) + index * floats;
+    }
+};
+
+#endif
@@ -9,67 +9,400 @@
 #define STBI_FAILURE_USERMSG
 #include "external/stb_image.h"
 
+#include "color.h"
+#include "texture_tiles.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
+#include <filesystem>
 #include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+// How an image keeps its texels. Each image keeps exactly one of these.
+enum class texel_format {
+    automatic,  // srgb8 for 8- and 16-bit files, half for HDR files
+    srgb8,      // 3 bytes per texel as stored in the file, decoded through a table
+    half,       // 6 bytes per texel, linear 16-bit floats
+    float32     // 12 bytes per texel, linear
+};
 
 class rtw_image {
   public:
     rtw_image() {}
 
-    rtw_image(const char* image_filename) {
+    rtw_image(const char* image_filename, texel_format format = texel_format::automatic) {
+        auto path = find(image_filename);
+        if (path.empty() || !load(path, format))
+            std::cerr << "ERROR: Could not load image file '" << image_filename << "'.\n";
+    }
 
-        auto filename = std::string(image_filename);
-        auto imagedir = getenv("RTW_IMAGES");
+    // Looks for the file as given, then in $RTW_IMAGES and the images/
+    // directories up the tree. Returns an empty string if it is nowhere.
+    static std::string find(const std::string& filename) {
+        std::vector<std::string> candidates;
+        if (auto imagedir = getenv("RTW_IMAGES"))
+            candidates.push_back(std::string(imagedir) + "/" + filename);
+        candidates.push_back(filename);
+        std::string prefix = "images/";
+        for (int i = 0; i < 7; i++, prefix = "../" + prefix)
+            candidates.push_back(prefix + filename);
 
-        if (imagedir && load(std::string(imagedir) + "/" + image_filename)) return;
-        if (load(filename)) return;
-        if (load("images/" + filename)) return;
-        if (load("../images/" + filename)) return;
-        if (load("../../images/" + filename)) return;
-        if (load("../../../images/" + filename)) return;
-        if (load("../../../../images/" + filename)) return;
-        if (load("../../../../../images/" + filename)) return;
-        if (load("../../../../../../images/" + filename)) return;
+        std::error_code error;
+        for (const auto& candidate : candidates) {
+            if (std::filesystem::is_regular_file(candidate, error))
+                return candidate;
+        }
+        return std::string();
+    }
 
-        std::cerr << "ERROR: Could not load image file '" << image_filename << "'.\n";
+    // Images of at least this many texels are kept in a tiles file next to
+    // the image and read tile by tile as lookups need them, instead of being
+    // held in memory.
+    static size_t& tiled_threshold() {
+        static size_t texels = size_t(4096) * 4096;
+        return texels;
     }
 
-    ~rtw_image() {
-        delete[] bdata;
-        STBI_FREE(fdata);
+    // The format automatic stands for with this file.
+    static texel_format resolve_format(const std::string& filename, texel_format format) {
+        if (format != texel_format::automatic)
+            return format;
+        return stbi_is_hdr(filename.c_str()) ? texel_format::half : texel_format::srgb8;
     }
 
-    bool load(const std::string& filename) {
+    bool load(const std::string& filename, texel_format format = texel_format::automatic) {
+        bool hdr = stbi_is_hdr(filename.c_str());
+        format = resolve_format(filename, format);
 
-        auto n = bytes_per_pixel;
-        fdata = stbi_loadf(filename.c_str(), &image_width, &image_height, &n, bytes_per_pixel);
-        if (fdata == nullptr) return false;
+        storage = format;
+        tiles.reset();
 
-        bytes_per_scanline = image_width * bytes_per_pixel;
-        convert_to_bytes();
+        // A large image, or one converted before, is read from its tiles
+        // file if that is up to date.
+        int w, h, n;
+        std::error_code error;
+        bool large = stbi_info(filename.c_str(), &w, &h, &n) && size_t(w) * h >= tiled_threshold();
+        if ((large || std::filesystem::exists(texture_tile_file::path_for(filename), error)) && open_tiles(filename))
+            return true;
+
+        if (!decode(filename, hdr))
+            return fail();
+        build_mip_chain();
+
+        if (large)
+            convert_to_tiles(filename);
         return true;
     }
 
-    int width()  const { return (fdata == nullptr) ? 0 : image_width; }
-    int height() const { return (fdata == nullptr) ? 0 : image_height; }
+    int width()  const { return levels.empty() ? 0 : levels[0].width; }
+    int height() const { return levels.empty() ? 0 : levels[0].height; }
 
-    const unsigned char* pixel_data(int x, int y) const {
-        static unsigned char magenta[] = { 255, 0, 255 };
-        if (bdata == nullptr) return magenta;
+    texel_format format() const { return storage; }
 
-        x = clamp(x, 0, image_width);
-        y = clamp(y, 0, image_height);
+    int level_count() const { return int(levels.size()); }
 
-        return bdata + y*bytes_per_scanline + x*bytes_per_pixel;
+    bool is_tiled() const { return tiles != nullptr; }
+
+    // Memory held by the texels of every level. Tiled images hold none of
+    // their own; their tiles are counted by the tile cache.
+    size_t size_in_bytes() const {
+        size_t size = 0;
+        for (const auto& l : levels)
+            size += l.bytes.size() + l.halves.size() * sizeof(uint16_t) + l.floats.size() * sizeof(float);
+        return size;
+    }
+
+    // The linear color of a texel of a mip level; coordinates outside the
+    // level are clamped to its edge. A missing image is magenta.
+    color texel(int x, int y, int level_index = 0) const {
+        if (levels.empty()) return color(1, 0, 1);
+
+        const auto& l = levels[level_index];
+        x = clamp(x, 0, l.width);
+        y = clamp(y, 0, l.height);
+        if (tiles) {
+            const int size = texture_tile_file::tile_size;
+            return texture_tile_cache::shared().with_tile(*tiles, level_index, x / size, y / size,
+                [&](const unsigned char* tile) { return in_tile(tile, x % size, y % size); });
+        }
+        return fetch(l, size_t(y)*l.width + x);
+    }
+
+    // Trilinear filtering: the image averaged over a footprint around (s, t),
+    // both in [0,1] from the top left corner. Blends bilinear lookups in the
+    // two levels whose texels are closest to the footprint's width, given
+    // squared and in texels of the full-size level.
+    color filtered(double s, double t, double width_squared) const {
+        if (levels.empty()) return color(1, 0, 1);
+
+        double level = width_squared > 1 ? 0.5 * std::log2(width_squared) : 0.0;
+        int last = level_count() - 1;
+        if (level >= last)
+            return bilinear(s, t, last);
+
+        int lower = int(level);
+        double blend = level - lower;
+        if (blend <= 0)
+            return bilinear(s, t, lower);
+        return (1 - blend) * bilinear(s, t, lower) + blend * bilinear(s, t, lower + 1);
+    }
+
+    color bilinear(double s, double t, int level_index) const {
+        const auto& l = levels[level_index];
+        double x = s * l.width - 0.5, y = t * l.height - 0.5;
+        double left = std::floor(x), top = std::floor(y);
+        double fx = x - left, fy = y - top;
+
+        int x0 = clamp(int(left), 0, l.width), x1 = clamp(int(left) + 1, 0, l.width);
+        int y0 = clamp(int(top), 0, l.height), y1 = clamp(int(top) + 1, 0, l.height);
+
+        auto blend = [&](const color& c00, const color& c10, const color& c01, const color& c11) {
+            return (1 - fy) * ((1 - fx) * c00 + fx * c10) + fy * ((1 - fx) * c01 + fx * c11);
+        };
+
+        if (tiles) {
+            // Most lookups fall inside one tile, which takes a single trip to
+            // the cache.
+            const int size = texture_tile_file::tile_size;
+            if (x0 / size != x1 / size || y0 / size != y1 / size)
+                return blend(texel(x0, y0, level_index), texel(x1, y0, level_index),
+                             texel(x0, y1, level_index), texel(x1, y1, level_index));
+
+            return texture_tile_cache::shared().with_tile(*tiles, level_index, x0 / size, y0 / size,
+                [&](const unsigned char* tile) {
+                    int u0 = x0 % size, u1 = x1 % size, v0 = y0 % size, v1 = y1 % size;
+                    return blend(in_tile(tile, u0, v0), in_tile(tile, u1, v0),
+                                 in_tile(tile, u0, v1), in_tile(tile, u1, v1));
+                });
+        }
+
+        size_t row0 = size_t(y0) * l.width, row1 = size_t(y1) * l.width;
+        return blend(fetch(l, row0 + x0), fetch(l, row0 + x1), fetch(l, row1 + x0), fetch(l, row1 + x1));
+    }
+
+    static double srgb_to_linear(double value) {
+        return value <= 0.04045 ? value / 12.92 : std::pow((value + 0.055) / 1.055, 2.4);
+    }
+
+    static double linear_to_srgb(double value) {
+        return value <= 0.0031308 ? 12.92 * value : 1.055 * std::pow(value, 1 / 2.4) - 0.055;
+    }
+
+    // IEEE 754 binary16, rounded to nearest even
+    static uint16_t float_to_half(float value) {
+        uint32_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        uint16_t sign = uint16_t((bits >> 16) & 0x8000);
+        uint32_t magnitude = bits & 0x7fffffff;
+
+        if (magnitude >= 0x7f800000)                        // Infinity or NaN
+            return sign | 0x7c00 | (magnitude > 0x7f800000 ? 0x200 : 0);
+        if (magnitude >= 0x477ff000)                        // Rounds past the largest half
+            return sign | 0x7c00;
+        if (magnitude < 0x38800000) {                       // Subnormal half
+            float f;
+            std::memcpy(&f, &magnitude, sizeof(f));
+            return sign | uint16_t(std::nearbyint(f * 0x1p24f));
+        }
+
+        magnitude += 0xfff + ((magnitude >> 13) & 1);
+        return sign | uint16_t((magnitude - 0x38000000) >> 13);
+    }
+
+    static float half_to_float(uint16_t half) {
+        uint32_t sign = uint32_t(half & 0x8000) << 16;
+        uint32_t exponent = (half >> 10) & 0x1f;
+        uint32_t mantissa = half & 0x3ff;
+
+        uint32_t bits;
+        if (exponent == 0x1f) {
+            bits = sign | 0x7f800000 | (mantissa << 13);
+        } else if (exponent != 0) {
+            bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+        } else {
+            float value = mantissa * 0x1p-24f;
+            return sign ? -value : value;
+        }
+
+        float value;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
     }
 
   private:
-    const int      bytes_per_pixel = 3;
-    float         *fdata = nullptr;
-    unsigned char *bdata = nullptr;
-    int            image_width = 0;
-    int            image_height = 0;
-    int            bytes_per_scanline = 0;
+    static const int bytes_per_pixel = 3;
+
+    // One level of the mip chain. Only the vector matching storage holds data.
+    struct level {
+        int width = 0;
+        int height = 0;
+        std::vector<unsigned char> bytes;
+        std::vector<uint16_t>      halves;
+        std::vector<float>         floats;
+    };
+
+    texel_format       storage = texel_format::srgb8;
+    std::vector<level> levels;  // The full-size image first, then each half as large
+
+    // Set when the texels are in a tiles file; levels then hold only sizes.
+    std::unique_ptr<texture_tile_file> tiles;
+
+    static size_t texel_count(const level& l) { return size_t(l.width) * l.height; }
+
+    color fetch(const level& l, size_t texel_index) const {
+        size_t i = texel_index * bytes_per_pixel;
+        switch (storage) {
+            case texel_format::half:
+                return color(half_to_float(l.halves[i]), half_to_float(l.halves[i+1]), half_to_float(l.halves[i+2]));
+            case texel_format::float32:
+                return color(l.floats[i], l.floats[i+1], l.floats[i+2]);
+            default: {
+                const float* table = srgb_table();
+                return color(table[l.bytes[i]], table[l.bytes[i+1]], table[l.bytes[i+2]]);
+            }
+        }
+    }
+
+    size_t texel_bytes() const {
+        switch (storage) {
+            case texel_format::half:    return bytes_per_pixel * sizeof(uint16_t);
+            case texel_format::float32: return bytes_per_pixel * sizeof(float);
+            default:                    return bytes_per_pixel;
+        }
+    }
+
+    // The texel at (x, y) of a tile, in the same layout as a level's texels.
+    color in_tile(const unsigned char* tile, int x, int y) const {
+        const unsigned char* t = tile + (size_t(y) * texture_tile_file::tile_size + x) * texel_bytes();
+        switch (storage) {
+            case texel_format::half: {
+                uint16_t h[3];
+                std::memcpy(h, t, sizeof(h));
+                return color(half_to_float(h[0]), half_to_float(h[1]), half_to_float(h[2]));
+            }
+            case texel_format::float32: {
+                float f[3];
+                std::memcpy(f, t, sizeof(f));
+                return color(f[0], f[1], f[2]);
+            }
+            default: {
+                const float* table = srgb_table();
+                return color(table[t[0]], table[t[1]], table[t[2]]);
+            }
+        }
+    }
+
+    bool open_tiles(const std::string& filename) {
+        auto file = std::make_unique<texture_tile_file>();
+        if (!file->open(filename, uint32_t(storage), uint32_t(texel_bytes())))
+            return false;
+
+        levels.assign(file->level_count(), level());
+        for (int i = 0; i < file->level_count(); i++) {
+            levels[i].width = file->level(i).width;
+            levels[i].height = file->level(i).height;
+        }
+        tiles = std::move(file);
+        return true;
+    }
+
+    // Writes the decoded levels to a tiles file and switches to it, freeing
+    // the texels in memory. If the file cannot be written the image stays in
+    // memory.
+    void convert_to_tiles(const std::string& filename) {
+        std::vector<texture_tile_file::level_source> sources;
+        for (const auto& l : levels) {
+            const void* texels = storage == texel_format::half    ? static_cast<const void*>(l.halves.data())
+                               : storage == texel_format::float32 ? static_cast<const void*>(l.floats.data())
+                               : static_cast<const void*>(l.bytes.data());
+            sources.push_back({l.width, l.height, texels});
+        }
+
+        if (!texture_tile_file::write(filename, uint32_t(storage), uint32_t(texel_bytes()), sources)
+            || !open_tiles(filename)) {
+            std::clog << "Could not write tiles for " << filename << ", keeping it in memory\n";
+            return;
+        }
+        std::clog << "Wrote tiles for " << filename << " to " << texture_tile_file::path_for(filename) << '\n';
+    }
+
+    // Reads the full-size level from the image file.
+    bool decode(const std::string& filename, bool hdr) {
+        levels.assign(1, level());
+        auto& base = levels[0];
+
+        int n = bytes_per_pixel;
+        if (!hdr && storage == texel_format::srgb8) {
+            // 8-bit data is kept exactly as decoded.
+            auto* data = stbi_load(filename.c_str(), &base.width, &base.height, &n, bytes_per_pixel);
+            if (data == nullptr) return false;
+            base.bytes.assign(data, data + texel_count(base) * bytes_per_pixel);
+            stbi_image_free(data);
+        } else {
+            // Anything else goes through linear floats. Integer files are
+            // decoded with the sRGB curve here, not stb_image's plain 2.2 gamma.
+            std::vector<float> linear;
+            if (hdr) {
+                auto* data = stbi_loadf(filename.c_str(), &base.width, &base.height, &n, bytes_per_pixel);
+                if (data == nullptr) return false;
+                linear.assign(data, data + texel_count(base) * bytes_per_pixel);
+                stbi_image_free(data);
+            } else {
+                auto* data = stbi_load_16(filename.c_str(), &base.width, &base.height, &n, bytes_per_pixel);
+                if (data == nullptr) return false;
+                linear.resize(texel_count(base) * bytes_per_pixel);
+                for (size_t i = 0; i < linear.size(); i++)
+                    linear[i] = float(srgb_to_linear(data[i] / 65535.0));
+                stbi_image_free(data);
+            }
+            store(base, linear);
+        }
+
+        return true;
+    }
+
+    bool fail() {
+        levels.clear();
+        tiles.reset();
+        return false;
+    }
+
+    // Each level averages the boxes of texels of the level above that its
+    // texels cover, in linear color.
+    void build_mip_chain() {
+        while (levels.back().width > 1 || levels.back().height > 1) {
+            int source = level_count() - 1;
+            level next;
+            next.width = std::max(1, levels[source].width / 2);
+            next.height = std::max(1, levels[source].height / 2);
+
+            double sx = double(levels[source].width) / next.width;
+            double sy = double(levels[source].height) / next.height;
+            std::vector<float> linear(texel_count(next) * bytes_per_pixel);
+            for (int y = 0; y < next.height; y++) {
+                int y0 = int(y * sy), y1 = std::max(y0 + 1, int(std::ceil((y + 1) * sy)));
+                for (int x = 0; x < next.width; x++) {
+                    int x0 = int(x * sx), x1 = std::max(x0 + 1, int(std::ceil((x + 1) * sx)));
+                    color sum(0, 0, 0);
+                    for (int yy = y0; yy < y1; yy++) {
+                        for (int xx = x0; xx < x1; xx++)
+                            sum += texel(xx, yy, source);
+                    }
+                    sum /= double((x1 - x0) * (y1 - y0));
+                    for (int c = 0; c < 3; c++)
+                        linear[(size_t(y)*next.width + x)*bytes_per_pixel + c] = float(sum[c]);
+                }
+            }
+
+            store(next, linear);
+            levels.push_back(std::move(next));
+        }
+    }
 
     static int clamp(int x, int low, int high) {
         if (x < low) return low;
@@ -77,23 +410,34 @@ class rtw_image {
         return high - 1;
     }
 
-    static unsigned char float_to_byte(float value) {
-        if (value <= 0.0)
-            return 0;
-        if (1.0 <= value)
-            return 255;
-        return static_cast<unsigned char>(256.0 * value);
+    static const float* srgb_table() {
+        static const std::vector<float> table = [] {
+            std::vector<float> t(256);
+            for (int i = 0; i < 256; i++)
+                t[i] = float(srgb_to_linear(i / 255.0));
+            return t;
+        }();
+        return table.data();
     }
 
-    void convert_to_bytes() {
-
-        int total_bytes = image_width * image_height * bytes_per_pixel;
-        bdata = new unsigned char[total_bytes];
-
-        auto *bptr = bdata;
-        auto *fptr = fdata;
-        for (auto i=0; i < total_bytes; i++, fptr++, bptr++)
-            *bptr = float_to_byte(*fptr);
+    void store(level& target, const std::vector<float>& linear) const {
+        switch (storage) {
+            case texel_format::half:
+                target.halves.resize(linear.size());
+                for (size_t i = 0; i < linear.size(); i++)
+                    target.halves[i] = float_to_half(linear[i]);
+                break;
+            case texel_format::float32:
+                target.floats = linear;
+                break;
+            default:
+                target.bytes.resize(linear.size());
+                for (size_t i = 0; i < linear.size(); i++) {
+                    double v = linear[i] <= 0 ? 0 : linear[i] >= 1 ? 1 : linear_to_srgb(linear[i]);
+                    target.bytes[i] = static_cast<unsigned char>(std::lround(255 * v));
+                }
+                break;
+        }
     }
 };
 
@@ -101,4 +445,4 @@ class rtw_image {
     #pragma warning (pop)
 #endif
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,333 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "commons.h"
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+enum class sampler_type {
+    independent,  // Uncorrelated random numbers
+    stratified,   // Correlated multi-jittered strata over the samples of a pixel
+    sobol,        // Owen-scrambled Sobol points
+    blue_noise    // Sobol points shifted by a blue-noise mask, so neighbouring
+                  // pixels make different errors
+};
+
+struct uv_sample {
+    double u;
+    double v;
+};
+
+// Hands out the numbers of one sample of a pixel, one dimension at a time.
+//
+// Every vertex of a path owns a fixed block of dimensions: vertex 0 is the
+// camera ray, vertex n the n-th bounce. A bounce that draws a varying number of
+// values therefore never shifts the dimensions of the bounces after it, and
+// draws beyond a vertex's block fall back to plain random numbers.
+class sampler {
+  public:
+    static const uint32_t dimensions_per_vertex = 8;
+
+    virtual ~sampler() = default;
+
+    void start_pixel_sample(int x, int y, uint64_t pixel, uint32_t index) {
+        px = x;
+        py = y;
+        pixel_index = pixel;
+        sample_index = index;
+        seed_random(pixel, index);
+        start_vertex(0);
+    }
+
+    void start_vertex(int vertex) {
+        dimension = uint32_t(vertex) * dimensions_per_vertex;
+        block_end = dimension + dimensions_per_vertex;
+    }
+
+    double get_1d() {
+        if (dimension >= block_end)
+            return random_double();
+        return value_1d(dimension++);
+    }
+
+    uv_sample get_2d() {
+        if (dimension + 2 > block_end) {
+            dimension = block_end;
+            return {random_double(), random_double()};
+        }
+        auto s = value_2d(dimension);
+        dimension += 2;
+        return s;
+    }
+
+    // While a scope is alive, sample_1d() and sample_2d() on its thread draw
+    // from the given sampler.
+    class scope {
+      public:
+        explicit scope(sampler& s) : previous(current()) { current() = &s; }
+        ~scope() { current() = previous; }
+
+        scope(const scope&) = delete;
+        scope& operator=(const scope&) = delete;
+
+      private:
+        sampler* previous;
+    };
+
+    static sampler*& current() {
+        thread_local sampler* active = nullptr;
+        return active;
+    }
+
+  protected:
+    int px = 0;
+    int py = 0;
+    uint64_t pixel_index = 0;
+    uint32_t sample_index = 0;
+
+    virtual double value_1d(uint32_t dimension) const = 0;
+    virtual uv_sample value_2d(uint32_t dimension) const = 0;
+
+    // A seed for one dimension of this pixel, or of every pixel.
+    uint64_t seed(uint32_t dimension, bool per_pixel = true) const {
+        uint64_t key = per_pixel ? pixel_index * 0x9e3779b97f4a7c15ULL : 0x5851f42d4c957f2dULL;
+        return mix_bits(key + mix_bits(dimension + 0x632be59bd9b4e019ULL));
+    }
+
+    static double to_unit(uint32_t bits) { return bits * 0x1.0p-32; }
+
+  private:
+    uint32_t dimension = 0;
+    uint32_t block_end = 0;
+};
+
+class independent_sampler : public sampler {
+  protected:
+    double value_1d(uint32_t dimension) const override {
+        return (hash(dimension) >> 11) * 0x1.0p-53;
+    }
+
+    uv_sample value_2d(uint32_t dimension) const override {
+        return {value_1d(dimension), value_1d(dimension + 1)};
+    }
+
+  private:
+    uint64_t hash(uint32_t dimension) const {
+        return mix_bits(seed(dimension) + (sample_index + 1) * 0xd1b54a32d192ed03ULL);
+    }
+};
+
+// Kensler's correlated multi-jittering: the samples of a pixel fall into an
+// m x n grid of cells and into every row and column strip once. Samples past
+// samples_per_pixel start a new, differently permuted pattern.
+class stratified_sampler : public sampler {
+  public:
+    explicit stratified_sampler(int samples_per_pixel)
+      : count(uint32_t(std::max(samples_per_pixel, 1))) {
+        columns = std::max(1u, uint32_t(std::sqrt(double(count))));
+        rows = (count + columns - 1) / columns;
+    }
+
+  protected:
+    double value_1d(uint32_t dimension) const override {
+        uint32_t p = pattern(dimension);
+        uint32_t s = permute(sample_index % count, count, p * 0x68bc21ebu);
+        return (s + jitter(s, p * 0x967a889bu)) / count;
+    }
+
+    uv_sample value_2d(uint32_t dimension) const override {
+        uint32_t p = pattern(dimension);
+        uint32_t s = permute(sample_index % count, count, p * 0x51633e2du);
+        uint32_t sx = permute(s % columns, columns, p * 0xa511e9b3u);
+        uint32_t sy = permute(s / columns, rows, p * 0x63d83595u);
+        double jx = jitter(s, p * 0xa399d265u);
+        double jy = jitter(s, p * 0x711ad6a5u);
+        return {(s % columns + (sy + jx) / rows) / columns,
+                (s / columns + (sx + jy) / columns) / rows};
+    }
+
+  private:
+    uint32_t count;
+    uint32_t columns;
+    uint32_t rows;
+
+    uint32_t pattern(uint32_t dimension) const {
+        return uint32_t(mix_bits(seed(dimension) + sample_index / count));
+    }
+
+    static double jitter(uint32_t s, uint32_t p) {
+        return to_unit(uint32_t(mix_bits((uint64_t(p) << 32) | s)));
+    }
+
+    // A pseudo-random permutation of [0, length) chosen by p.
+    static uint32_t permute(uint32_t i, uint32_t length, uint32_t p) {
+        if (length <= 1)
+            return 0;
+
+        uint32_t w = length - 1;
+        w |= w >> 1; w |= w >> 2; w |= w >> 4; w |= w >> 8; w |= w >> 16;
+        do {
+            i ^= p;             i *= 0xe170893du;
+            i ^= p >> 16;       i ^= (i & w) >> 4;
+            i ^= p >> 8;        i *= 0x0929eb3fu;
+            i ^= p >> 23;       i ^= (i & w) >> 1;
+            i *= 1 | p >> 27;   i *= 0x6935fa69u;
+            i ^= (i & w) >> 11; i *= 0x74dcb303u;
+            i ^= (i & w) >> 2;  i *= 0x9e501cc3u;
+            i ^= (i & w) >> 2;  i *= 0xc860a3dfu;
+            i &= w;             i ^= i >> 5;
+        } while (i >= length);
+        return (i + p) % length;
+    }
+};
+
+// The first two Sobol dimensions, with the sample order shuffled and the
+// points Owen-scrambled per dimension (Burley, "Practical Hash-based Owen
+// Scrambling"). Every pair of dimensions is a well-stratified 2D point set,
+// and the pairs are decorrelated from each other by their seeds.
+class sobol_sampler : public sampler {
+  protected:
+    double value_1d(uint32_t dimension) const override {
+        uint32_t s = uint32_t(seed(dimension, per_pixel()));
+        uint32_t i = nested_uniform_scramble(sample_index, s);
+        return shift(to_unit(nested_uniform_scramble(reverse_bits(i), hash(s))), dimension, 0);
+    }
+
+    uv_sample value_2d(uint32_t dimension) const override {
+        uint32_t s = uint32_t(seed(dimension, per_pixel()));
+        uint32_t i = nested_uniform_scramble(sample_index, s);
+        uint32_t u = nested_uniform_scramble(reverse_bits(i), hash(s));
+        uint32_t v = nested_uniform_scramble(sobol_second(i), hash(hash(s)));
+        return {shift(to_unit(u), dimension, 0), shift(to_unit(v), dimension, 1)};
+    }
+
+    // The blue-noise sampler uses the same points in every pixel and moves
+    // them by a per-pixel offset instead.
+    virtual bool per_pixel() const { return true; }
+    virtual double shift(double value, uint32_t, int) const { return value; }
+
+  private:
+    static uint32_t reverse_bits(uint32_t x) {
+        x = (x << 16) | (x >> 16);
+        x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+        x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+        x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+        x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+        return x;
+    }
+
+    static uint32_t sobol_second(uint32_t index) {
+        uint32_t result = 0;
+        for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1) {
+            if (index & 1)
+                result ^= v;
+        }
+        return result;
+    }
+
+    static uint32_t hash(uint32_t x) { return uint32_t(mix_bits(x)); }
+
+    static uint32_t laine_karras_permutation(uint32_t x, uint32_t seed) {
+        x += seed;
+        x ^= x * 0x6c50b47cu;
+        x ^= x * 0xb82f1e52u;
+        x ^= x * 0xc7afe638u;
+        x ^= x * 0x8d22f6e6u;
+        return x;
+    }
+
+    static uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+        return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+    }
+};
+
+// Sobol points shared by all pixels, each pixel offset (modulo 1) by a value
+// from a 64x64 blue-noise mask (Georgiev and Fajardo, "Blue-noise Dithered
+// Sampling"). At low sample counts the error looks like fine grain instead of
+// blotches. Every dimension reads the mask at a different offset.
+class blue_noise_sampler : public sobol_sampler {
+  protected:
+    bool per_pixel() const override { return false; }
+
+    double shift(double value, uint32_t dimension, int axis) const override {
+        auto offset = mix_bits(dimension * 2 + axis + 1);
+        int x = (px + int(offset & 63)) & 63;
+        int y = (py + int((offset >> 6) & 63)) & 63;
+        value += mask()[y * 64 + x];
+        return value < 1 ? value : value - 1;
+    }
+
+  private:
+    // Ranks the cells of a torus by repeatedly picking the emptiest one, as in
+    // the void-and-cluster method, and turns the ranks into values in (0, 1).
+    static const std::vector<float>& mask() {
+        static const std::vector<float> values = [] {
+            const int size = 64, cells = size * size;
+            const double sigma = 1.5;
+
+            std::vector<double> kernel(cells);
+            for (int y = 0; y < size; y++) {
+                for (int x = 0; x < size; x++) {
+                    int dx = std::min(x, size - x), dy = std::min(y, size - y);
+                    kernel[y * size + x] = std::exp(-(dx*dx + dy*dy) / (2 * sigma * sigma));
+                }
+            }
+
+            // A little noise breaks the ties between equally empty cells.
+            std::vector<double> energy(cells);
+            for (int i = 0; i < cells; i++)
+                energy[i] = 1e-9 * (mix_bits(i) >> 11) * 0x1.0p-53;
+
+            std::vector<float> result(cells);
+            std::vector<bool> taken(cells, false);
+            for (int rank = 0; rank < cells; rank++) {
+                int best = -1;
+                for (int i = 0; i < cells; i++) {
+                    if (!taken[i] && (best < 0 || energy[i] < energy[best]))
+                        best = i;
+                }
+
+                taken[best] = true;
+                result[best] = (rank + 0.5f) / cells;
+
+                int bx = best % size, by = best / size;
+                for (int y = 0; y < size; y++) {
+                    for (int x = 0; x < size; x++)
+                        energy[y * size + x] += kernel[((y - by) & (size - 1)) * size + ((x - bx) & (size - 1))];
+                }
+            }
+            return result;
+        }();
+        return values;
+    }
+};
+
+inline std::unique_ptr<sampler> make_sampler(sampler_type type, int samples_per_pixel) {
+    switch (type) {
+        case sampler_type::stratified: return std::make_unique<stratified_sampler>(samples_per_pixel);
+        case sampler_type::sobol:      return std::make_unique<sobol_sampler>();
+        case sampler_type::blue_noise: return std::make_unique<blue_noise_sampler>();
+        default:                       return std::make_unique<independent_sampler>();
+    }
+}
+
+// The next values of the current path vertex, from the thread's sampler, or
+// plain random numbers outside of a render.
+inline double sample_1d() {
+    auto* s = sampler::current();
+    return s ? s->get_1d() : random_double();
+}
+
+inline uv_sample sample_2d() {
+    auto* s = sampler::current();
+    return s ? s->get_2d() : uv_sample{random_double(), random_double()};
+}
+
+inline void start_path_vertex(int vertex) {
+    if (auto* s = sampler::current())
+        s->start_vertex(vertex);
+}
+
+#endif
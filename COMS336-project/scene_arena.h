@@ -0,0 +1,123 @@
+#ifndef SCENE_ARENA_H
+#define SCENE_ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+// Memory for the objects a scene is built from. Objects are placed one after the
+// other in large blocks, in the order the scene creates them, and are never
+// freed one by one: the blocks are released together once the arena and every
+// object made from it are gone. Objects are still handed out as shared_ptrs, so
+// the rest of the code does not need to know where they live.
+//
+// An arena is meant to be filled by one thread while the scene is built.
+class scene_arena {
+  public:
+    explicit scene_arena(size_t block_size = 1 << 20)
+      : storage(std::make_shared<blocks>(block_size)) {}
+
+    template <typename T, typename... Args>
+    std::shared_ptr<T> make(Args&&... args) {
+        return std::allocate_shared<T>(allocator<T>(storage), std::forward<Args>(args)...);
+    }
+
+    size_t bytes_used() const { return storage->used; }
+
+    // While a scope is alive, make_scene_object() on its thread allocates from
+    // the given arena.
+    class scope {
+      public:
+        explicit scope(scene_arena& arena) : previous(current()) { current() = &arena; }
+        ~scope() { current() = previous; }
+
+        scope(const scope&) = delete;
+        scope& operator=(const scope&) = delete;
+
+      private:
+        scene_arena* previous;
+    };
+
+    static scene_arena*& current() {
+        thread_local scene_arena* arena = nullptr;
+        return arena;
+    }
+
+  private:
+    struct blocks {
+        size_t block_size;
+        size_t used = 0;
+        size_t offset = 0;
+        unsigned char* current = nullptr;  // Block that small objects are bumped from
+        std::vector<std::unique_ptr<unsigned char[]>> list;
+
+        explicit blocks(size_t block_size) : block_size(block_size) {}
+
+        void* allocate(size_t bytes, size_t alignment) {
+            used += bytes;
+
+            // Oversized requests get a block of their own, and the current
+            // block stays in use.
+            if (bytes + alignment > block_size) {
+                list.emplace_back(new unsigned char[bytes + alignment]);
+                auto* base = list.back().get();
+                return base + padding(base, alignment);
+            }
+
+            size_t start = current ? offset + padding(current + offset, alignment) : 0;
+            if (!current || start + bytes > block_size) {
+                list.emplace_back(new unsigned char[block_size]);
+                current = list.back().get();
+                start = padding(current, alignment);
+            }
+
+            offset = start + bytes;
+            return current + start;
+        }
+
+        static size_t padding(const unsigned char* p, size_t alignment) {
+            return (alignment - reinterpret_cast<uintptr_t>(p) % alignment) % alignment;
+        }
+    };
+
+    // Hands out arena memory; deallocation is a no-op. Every copy shares the
+    // blocks, so objects keep the memory they live in alive.
+    template <typename T>
+    struct allocator {
+        typedef T value_type;
+
+        std::shared_ptr<blocks> storage;
+
+        explicit allocator(std::shared_ptr<blocks> storage) : storage(std::move(storage)) {}
+
+        template <typename U>
+        allocator(const allocator<U>& other) : storage(other.storage) {}
+
+        T* allocate(size_t n) {
+            return static_cast<T*>(storage->allocate(n * sizeof(T), alignof(T)));
+        }
+
+        void deallocate(T*, size_t) {}
+
+        template <typename U>
+        bool operator==(const allocator<U>& other) const { return storage == other.storage; }
+
+        template <typename U>
+        bool operator!=(const allocator<U>& other) const { return storage != other.storage; }
+    };
+
+    std::shared_ptr<blocks> storage;
+};
+
+// Makes a scene object in the current thread's arena, or on the heap when no
+// arena scope is active.
+template <typename T, typename... Args>
+std::shared_ptr<T> make_scene_object(Args&&... args) {
+    if (auto* arena = scene_arena::current())
+        return arena->make<T>(std::forward<Args>(args)...);
+    return std::make_shared<T>(std::forward<Args>(args)...);
+}
+
+#endif
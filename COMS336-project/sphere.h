@@ -3,6 +3,8 @@
 
 #include "canbehit.h"
 #include "commons.h"
+#include "material.h"
+#include "onb.h"
 
 class sphere : public canbehit {
     public:
@@ -50,29 +52,80 @@ class sphere : public canbehit {
                     return false;
             }
 
-            rec.t = root;
+            rec.set_hit(root, this);
+            return true;
+        }
 
+        void compute_interaction(const ray& r, hit_record& rec) const override {
             rec.p = r.at(rec.t);
 
-            vec3 outward_normal = (rec.p - current_center) / radius;
+            vec3 outward_normal = (rec.p - center.at(r.time())) / radius;
 
             rec.set_face_normal(r, outward_normal);
 
             get_sphere_uv(outward_normal, rec.u, rec.v);
 
-            rec.mat = mat;
-            
-            return true;
+            // Derivatives of the point along u (around the y axis) and v (from
+            // pole to pole); dpdv vanishes at the poles.
+            double x = outward_normal.x(), y = outward_normal.y(), z = outward_normal.z();
+            double ring = std::sqrt(x*x + z*z);
+            rec.dpdu = 2*pi*radius * vec3(z, 0, -x);
+            if (ring > 1e-9)
+                rec.dpdv = pi*radius * vec3(-y*x/ring, ring, -y*z/ring);
+
+            rec.mat = mat.get();
         }
 
         aabb bounding_box() const override { return bbox; }
 
+        bool is_emitter() const override { return mat->is_emissive(); }
+
+        // Directions are picked uniformly within the cone the sphere fills
+        // as seen from origin.
+        double pdf_value(const point3& origin, const vec3& direction, double time) const override {
+            hit_record rec;
+            if (!hit(ray(origin, direction, time), interval(0.001, infinity), rec))
+                return 0;
+
+            double one_minus_cos;
+            if (!cone(origin, time, one_minus_cos))
+                return 0;
+
+            return 1 / (2*pi*one_minus_cos);
+        }
+
+        vec3 random(const point3& origin, double time) const override {
+            double one_minus_cos;
+            if (!cone(origin, time, one_minus_cos))
+                return random_unit_vector();
+
+            auto s = sample_2d();
+            auto one_minus_z = s.v * one_minus_cos;
+            auto sin_theta = std::sqrt(one_minus_z * (2 - one_minus_z));
+            auto phi = 2*pi*s.u;
+
+            onb uvw(center.at(time) - origin);
+            return uvw.transform(vec3(std::cos(phi)*sin_theta, std::sin(phi)*sin_theta, 1 - one_minus_z));
+        }
+
     private:
         ray center;
         double radius;
         shared_ptr<material> mat;
         aabb bbox;
 
+        // 1 - cos of the half angle of the cone, written so it stays accurate
+        // for small, distant spheres. False if origin is inside the sphere.
+        bool cone(const point3& origin, double time, double& one_minus_cos) const {
+            auto distance_squared = (center.at(time) - origin).length_squared();
+            auto sin2 = radius*radius / distance_squared;
+            if (sin2 >= 1)
+                return false;
+
+            one_minus_cos = sin2 / (1 + std::sqrt(1 - sin2));
+            return true;
+        }
+
         static void get_sphere_uv(const point3& p, double& u, double& v) {
         auto theta = std::acos(-p.y());
         auto phi = std::atan2(-p.z(), p.x()) + pi;
@@ -5,12 +5,19 @@
 #include "color.h"
 #include "perlin.h"
 #include "rtw_stb_image.h"
+#include "texture_registry.h"
 
 class texture {
   public:
     virtual ~texture() = default;
 
     virtual color value(double u, double v, const point3& p) const = 0;
+
+    // The texture averaged over the footprint of a pixel. Textures that do not
+    // filter take a point sample.
+    virtual color filtered_value(double u, double v, const point3& p, const uv_footprint& footprint) const {
+        return value(u, v, p);
+    }
 };
 
 class solid_color : public texture {
@@ -33,44 +40,61 @@ class checker_texture : public texture {
       : inv_scale(1.0 / scale), even(even), odd(odd) {}
 
     checker_texture(double scale, const color& c1, const color& c2)
-      : checker_texture(scale, make_shared<solid_color>(c1), make_shared<solid_color>(c2)) {}
+      : checker_texture(scale, make_scene_object<solid_color>(c1), make_scene_object<solid_color>(c2)) {}
 
     color value(double u, double v, const point3& p) const override {
-        auto xInteger = int(std::floor(inv_scale * p.x()));
-        auto yInteger = int(std::floor(inv_scale * p.y()));
-        auto zInteger = int(std::floor(inv_scale * p.z()));
-
-        bool isEven = (xInteger + yInteger + zInteger) % 2 == 0;
+        return pick(p).value(u, v, p);
+    }
 
-        return isEven ? even->value(u, v, p) : odd->value(u, v, p);
+    color filtered_value(double u, double v, const point3& p, const uv_footprint& footprint) const override {
+        return pick(p).filtered_value(u, v, p, footprint);
     }
 
   private:
     double inv_scale;
     shared_ptr<texture> even;
     shared_ptr<texture> odd;
+
+    const texture& pick(const point3& p) const {
+        auto xInteger = int(std::floor(inv_scale * p.x()));
+        auto yInteger = int(std::floor(inv_scale * p.y()));
+        auto zInteger = int(std::floor(inv_scale * p.z()));
+
+        bool isEven = (xInteger + yInteger + zInteger) % 2 == 0;
+
+        return isEven ? *even : *odd;
+    }
 };
 
 class image_texture : public texture {
   public:
-    image_texture(const char* filename) : image(filename) {}
+    // The image comes from the texture registry, so textures made from the
+    // same file share one copy of it.
+    image_texture(const char* filename, texel_format format = texel_format::automatic)
+      : image(texture_registry::shared().load(filename, format)) {}
+
+    image_texture(const rtw_image* image) : image(image) {}
 
     color value(double u, double v, const point3& p) const override {
-        if (image.height() <= 0) return color(0,1,1);
+        return filtered_value(u, v, p, uv_footprint());
+    }
+
+    // Trilinear lookup in the image's mip chain, at the level whose texels
+    // match the longer side of the footprint.
+    color filtered_value(double u, double v, const point3& p, const uv_footprint& footprint) const override {
+        if (image->height() <= 0) return color(0,1,1);
 
         u = interval(0,1).clamp(u);
         v = 1.0 - interval(0,1).clamp(v);
 
-        auto i = int(u * image.width());
-        auto j = int(v * image.height());
-        auto pixel = image.pixel_data(i,j);
-
-        auto color_scale = 1.0 / 255.0;
-        return color(color_scale*pixel[0], color_scale*pixel[1], color_scale*pixel[2]);
+        double w = image->width(), h = image->height();
+        double x_squared = footprint.dudx*footprint.dudx*w*w + footprint.dvdx*footprint.dvdx*h*h;
+        double y_squared = footprint.dudy*footprint.dudy*w*w + footprint.dvdy*footprint.dvdy*h*h;
+        return image->filtered(u, v, std::fmax(x_squared, y_squared));
     }
 
   private:
-    rtw_image image;
+    const rtw_image* image;
 };
 
 class noise_texture : public texture {
@@ -0,0 +1,70 @@
+#ifndef TEXTURE_REGISTRY_H
+#define TEXTURE_REGISTRY_H
+
+#include "rtw_stb_image.h"
+
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+// Every image file a texture uses, loaded once per storage format and kept for
+// the rest of the process. Textures hold a plain pointer to the image as their
+// handle, so any number of materials can use the same file for the cost of a
+// pointer each.
+class texture_registry {
+  public:
+    static texture_registry& shared() {
+        static texture_registry registry;
+        return registry;
+    }
+
+    // Never returns null: a file that cannot be loaded gives an empty image,
+    // which textures show as a solid color, and is reported once. automatic is
+    // resolved first, so asking for a file's default format by name shares
+    // the image.
+    const rtw_image* load(const std::string& filename, texel_format format = texel_format::automatic) {
+        auto path = rtw_image::find(filename);
+        std::error_code error;
+        auto key = path.empty() ? filename : std::filesystem::weakly_canonical(path, error).string();
+        if (!path.empty())
+            format = rtw_image::resolve_format(path, format);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        auto& image = images[{key, format}];
+        if (!image) {
+            image = std::make_unique<rtw_image>();
+            if (path.empty() || !image->load(path, format))
+                std::cerr << "ERROR: Could not load image file '" << filename << "'.\n";
+            bytes += image->size_in_bytes();
+        } else {
+            reuses++;
+        }
+        return image.get();
+    }
+
+    size_t image_count() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return images.size();
+    }
+
+    size_t reuse_count() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return reuses;
+    }
+
+    size_t bytes_used() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return bytes;
+    }
+
+  private:
+    mutable std::mutex mutex;
+    std::map<std::pair<std::string, texel_format>, std::unique_ptr<rtw_image>> images;
+    size_t reuses = 0;
+    size_t bytes = 0;
+};
+
+#endif
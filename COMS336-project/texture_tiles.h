@@ -0,0 +1,356 @@
+#ifndef TEXTURE_TILES_H
+#define TEXTURE_TILES_H
+
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// An image and its mip levels cut into square tiles, written next to the image
+// as "<file>.tiles". The file is memory-mapped and nothing is read up front:
+// each tile is read when a lookup first needs it, through the tile cache.
+//
+// Tiles of the edge are padded by repeating the last row and column, so every
+// tile has the same size. Tiles start on page boundaries of the machine that
+// wrote the file, which lets the cache hand a tile's pages back to the OS once
+// it has its own copy. A file written for smaller pages than this machine's is
+// rewritten.
+class texture_tile_file {
+  public:
+    static const int tile_size = 64;
+    static const int max_levels = 32;
+
+    // Raised whenever the layout of the header or of the tiles changes.
+    static const uint32_t version = 2;
+
+    struct level_info {
+        int32_t  width;
+        int32_t  height;
+        int32_t  tiles_x;
+        int32_t  tiles_y;
+        uint64_t first_tile;  // Index of the level's top-left tile in the file
+    };
+
+    // A level to write: rows from the top, texel_bytes per texel.
+    struct level_source {
+        int width;
+        int height;
+        const void* texels;
+    };
+
+    texture_tile_file() : file_id(next_id()) {}
+
+    texture_tile_file(const texture_tile_file&) = delete;
+    texture_tile_file& operator=(const texture_tile_file&) = delete;
+
+    static std::string path_for(const std::string& source) { return source + ".tiles"; }
+
+    // Maps the tiles of the given image. Fails if there are none, or if they
+    // were written for another version, texel format or state of the image.
+    bool open(const std::string& source, uint32_t format, uint32_t texel_bytes) {
+        file.close();
+
+        uint64_t source_size;
+        int64_t source_time;
+        if (!stamp(source, source_size, source_time) || !file.open(path_for(source)))
+            return false;
+
+        if (file.size() < sizeof(header)) {
+            file.close();
+            return false;
+        }
+
+        std::memcpy(&head, file.data(), sizeof(header));
+        bool valid = std::memcmp(head.magic, magic, sizeof(head.magic)) == 0
+                  && head.version == version
+                  && head.format == format
+                  && head.texel_bytes == texel_bytes
+                  && head.tile_size == tile_size
+                  && head.level_count > 0 && head.level_count <= max_levels
+                  && head.alignment >= sizeof(header)
+                  && head.alignment % mapped_file::page_size() == 0
+                  && head.source_size == source_size
+                  && head.source_time == source_time;
+
+        if (valid) {
+            const auto& last = head.levels[head.level_count - 1];
+            uint64_t tiles = last.first_tile + uint64_t(last.tiles_x) * last.tiles_y;
+            valid = data_offset() + tiles * tile_stride() <= file.size();
+        }
+
+        if (!valid)
+            file.close();
+        return valid;
+    }
+
+    bool valid() const { return file.valid(); }
+
+    uint64_t id() const { return file_id; }
+    int level_count() const { return int(head.level_count); }
+    const level_info& level(int index) const { return head.levels[index]; }
+    size_t tile_bytes() const { return size_t(tile_size) * tile_size * head.texel_bytes; }
+
+    // Distance between tiles in the file: tile_bytes rounded up to whole pages.
+    size_t tile_stride() const { return round_up(tile_bytes(), head.alignment); }
+
+    const unsigned char* tile(int level_index, int tile_x, int tile_y) const {
+        return reinterpret_cast<const unsigned char*>(file.data()) + tile_offset(level_index, tile_x, tile_y);
+    }
+
+    // Lets the OS drop the tile's pages from this process. Returns false if
+    // the OS refused.
+    bool release(int level_index, int tile_x, int tile_y) const {
+        return file.release(tile_offset(level_index, tile_x, tile_y), tile_stride());
+    }
+
+    // Writes the tiles of an image. The file is written under a temporary name
+    // and renamed, so other runs never map a half-written file.
+    static bool write(const std::string& source, uint32_t format, uint32_t texel_bytes,
+                      const std::vector<level_source>& levels) {
+        if (levels.empty() || levels.size() > size_t(max_levels))
+            return false;
+
+        header h;
+        std::memset(&h, 0, sizeof(h));
+        std::memcpy(h.magic, magic, sizeof(h.magic));
+        h.version = version;
+        h.format = format;
+        h.texel_bytes = texel_bytes;
+        h.tile_size = tile_size;
+        h.alignment = uint32_t(std::max(mapped_file::page_size(), size_t(4096)));
+        h.level_count = uint32_t(levels.size());
+        if (!stamp(source, h.source_size, h.source_time))
+            return false;
+
+        uint64_t tiles = 0;
+        for (size_t i = 0; i < levels.size(); i++) {
+            auto& l = h.levels[i];
+            l.width = levels[i].width;
+            l.height = levels[i].height;
+            l.tiles_x = (l.width + tile_size - 1) / tile_size;
+            l.tiles_y = (l.height + tile_size - 1) / tile_size;
+            l.first_tile = tiles;
+            tiles += uint64_t(l.tiles_x) * l.tiles_y;
+        }
+
+        auto target = path_for(source);
+        auto temporary = target + ".tmp";
+        {
+            std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+            if (!out)
+                return false;
+
+            std::vector<char> padding(h.alignment - sizeof(header), 0);
+            out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+            out.write(padding.data(), std::streamsize(padding.size()));
+
+            size_t row_bytes = size_t(tile_size) * texel_bytes;
+            std::vector<char> tile(round_up(row_bytes * tile_size, h.alignment), 0);
+            for (size_t i = 0; i < levels.size(); i++) {
+                const auto& l = h.levels[i];
+                const char* texels = static_cast<const char*>(levels[i].texels);
+                for (int ty = 0; ty < l.tiles_y; ty++) {
+                    for (int tx = 0; tx < l.tiles_x; tx++) {
+                        for (int y = 0; y < tile_size; y++) {
+                            int sy = std::min(ty * tile_size + y, l.height - 1);
+                            for (int x = 0; x < tile_size; x++) {
+                                int sx = std::min(tx * tile_size + x, l.width - 1);
+                                std::memcpy(&tile[y * row_bytes + size_t(x) * texel_bytes],
+                                            texels + (size_t(sy) * l.width + sx) * texel_bytes, texel_bytes);
+                            }
+                        }
+                        out.write(tile.data(), std::streamsize(tile.size()));
+                    }
+                }
+            }
+
+            if (!out)
+                return false;
+        }
+
+        std::remove(target.c_str());
+        return std::rename(temporary.c_str(), target.c_str()) == 0;
+    }
+
+  private:
+    static constexpr char magic[8] = {'R', 'T', 'T', 'I', 'L', 'E', 'S', 0};
+
+    struct header {
+        char       magic[8];
+        uint32_t   version;
+        uint32_t   format;       // Set by the image, which knows how to decode it
+        uint32_t   texel_bytes;
+        uint32_t   tile_size;
+        uint32_t   level_count;
+        uint32_t   alignment;    // Page size the header and tiles are padded to
+        uint64_t   source_size;  // Size and modification time of the image file
+        int64_t    source_time;  // the tiles were built from
+        level_info levels[max_levels];
+    };
+
+    static_assert(sizeof(header) <= 4096, "the header must fit in front of the first tile");
+
+    mapped_file file;
+    header head;
+    uint64_t file_id;
+
+    static uint64_t next_id() {
+        static std::atomic<uint64_t> count{0};
+        return count++;
+    }
+
+    static size_t round_up(size_t bytes, size_t alignment) {
+        return (bytes + alignment - 1) / alignment * alignment;
+    }
+
+    // The header takes the first page, and tiles of every format are padded
+    // to whole pages.
+    size_t data_offset() const { return head.alignment; }
+
+    size_t tile_offset(int level_index, int tile_x, int tile_y) const {
+        const auto& l = head.levels[level_index];
+        uint64_t index = l.first_tile + uint64_t(tile_y) * l.tiles_x + tile_x;
+        return data_offset() + size_t(index) * tile_stride();
+    }
+
+    static bool stamp(const std::string& source, uint64_t& size, int64_t& time) {
+        std::error_code error;
+        size = std::filesystem::file_size(source, error);
+        if (error)
+            return false;
+
+        time = int64_t(std::filesystem::last_write_time(source, error).time_since_epoch().count());
+        return !error;
+    }
+};
+
+// The tiles that tiled images have read lately, shared by all images and
+// threads and bounded in size. The least recently used tiles are dropped to
+// make room for new ones.
+//
+// Tiles are spread over shards by a hash of their key, each with its own lock
+// and its share of the capacity, so threads reading different tiles seldom
+// wait for each other.
+class texture_tile_cache {
+  public:
+    explicit texture_tile_cache(size_t capacity = size_t(256) << 20) { set_capacity(capacity); }
+
+    texture_tile_cache(const texture_tile_cache&) = delete;
+    texture_tile_cache& operator=(const texture_tile_cache&) = delete;
+
+    static texture_tile_cache& shared() {
+        static texture_tile_cache cache;
+        return cache;
+    }
+
+    // Capacity in bytes. A smaller capacity applies as tiles are added.
+    void set_capacity(size_t bytes) {
+        for (auto& s : shards) {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            s.capacity = bytes / shard_count;
+        }
+    }
+
+    // Calls use() with the cached copy of a tile and returns what it returns.
+    // On a miss, the tile is copied in from the file first. The shard stays
+    // locked during use(), so it should only read a few texels.
+    template <typename F>
+    auto with_tile(const texture_tile_file& file, int level, int tile_x, int tile_y, F use)
+        -> decltype(use(static_cast<const unsigned char*>(nullptr))) {
+        uint64_t key = (file.id() << 40) ^ (uint64_t(level) << 34) ^ (uint64_t(tile_y) << 17) ^ uint64_t(tile_x);
+        auto& s = shards[mix(key) % shard_count];
+        std::lock_guard<std::mutex> lock(s.mutex);
+
+        auto found = s.index.find(key);
+        if (found != s.index.end()) {
+            hit_count.fetch_add(1, std::memory_order_relaxed);
+            s.tiles.splice(s.tiles.begin(), s.tiles, found->second);
+            return use(found->second->texels.data());
+        }
+
+        miss_count.fetch_add(1, std::memory_order_relaxed);
+        size_t bytes = file.tile_bytes();
+        while (!s.tiles.empty() && s.used + bytes > s.capacity) {
+            s.used -= s.tiles.back().texels.size();
+            s.index.erase(s.tiles.back().key);
+            s.tiles.pop_back();
+            eviction_count.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        const unsigned char* source = file.tile(level, tile_x, tile_y);
+        s.tiles.push_front({key, std::vector<unsigned char>(source, source + bytes)});
+        s.index[key] = s.tiles.begin();
+        s.used += bytes;
+        if (!file.release(level, tile_x, tile_y))
+            release_failure_count.fetch_add(1, std::memory_order_relaxed);
+
+        return use(s.tiles.front().texels.data());
+    }
+
+    uint64_t hits() const { return hit_count.load(); }
+    uint64_t misses() const { return miss_count.load(); }
+    uint64_t evictions() const { return eviction_count.load(); }
+
+    size_t resident_bytes() {
+        size_t total = 0;
+        for (auto& s : shards) {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            total += s.used;
+        }
+        return total;
+    }
+
+    void report(std::ostream& out) {
+        uint64_t lookups = hits() + misses();
+        if (lookups == 0)
+            return;
+        out << "Texture tiles: " << hits() << " hits, " << misses() << " misses ("
+            << 100.0 * hits() / lookups << "% hit rate), " << evictions() << " evicted, "
+            << resident_bytes() / 1024 << " KiB resident\n";
+        if (release_failure_count > 0) {
+            out << "Texture tiles: the OS refused to release " << release_failure_count.load()
+                << " mapped tiles, so the process may hold more than the cache capacity\n";
+        }
+    }
+
+  private:
+    static const int shard_count = 16;
+
+    struct entry {
+        uint64_t key;
+        std::vector<unsigned char> texels;
+    };
+
+    struct shard {
+        std::mutex mutex;
+        std::list<entry> tiles;  // Most recently used first
+        std::unordered_map<uint64_t, std::list<entry>::iterator> index;
+        size_t used = 0;
+        size_t capacity = 0;
+    };
+
+    shard shards[shard_count];
+    std::atomic<uint64_t> hit_count{0};
+    std::atomic<uint64_t> miss_count{0};
+    std::atomic<uint64_t> eviction_count{0};
+    std::atomic<uint64_t> release_failure_count{0};
+
+    static uint64_t mix(uint64_t x) {
+        x ^= x >> 33;
+        x *= 0xff51afd7ed558ccdULL;
+        x ^= x >> 33;
+        return x;
+    }
+};
+
+#endif
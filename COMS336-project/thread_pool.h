@@ -0,0 +1,170 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A persistent pool of worker threads. Every worker owns a task deque: it pops
+// its own work from the back and, once that runs dry, steals from the front of
+// the other workers' deques, so a few expensive tasks never leave threads idle.
+class thread_pool {
+  public:
+    explicit thread_pool(int thread_count = 0) {
+        if (thread_count <= 0)
+            thread_count = std::max(1, int(std::thread::hardware_concurrency()));
+
+        for (int i = 0; i < thread_count; i++)
+            queues.push_back(std::make_unique<work_queue>());
+
+        for (int i = 0; i < thread_count; i++)
+            workers.emplace_back([this, i] { worker_loop(i); });
+    }
+
+    ~thread_pool() {
+        {
+            std::lock_guard<std::mutex> lock(wake_mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+
+        for (auto& worker : workers)
+            worker.join();
+    }
+
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+
+    int size() const { return int(workers.size()); }
+
+    // A process-wide pool with one worker per hardware thread, for callers
+    // that were not handed a pool of their own.
+    static thread_pool& shared() {
+        static thread_pool pool;
+        return pool;
+    }
+
+    // Runs body(0) .. body(count-1) on the pool and returns once all of them
+    // are done. The calling thread helps out while it waits, so nested calls
+    // from inside a task cannot deadlock the pool.
+    void parallel_for(int count, const std::function<void(int)>& body) {
+        if (count <= 0)
+            return;
+
+        batch job;
+        job.remaining = count;
+
+        for (int i = 0; i < count; i++) {
+            submit([&job, &body, i] {
+                body(i);
+
+                std::lock_guard<std::mutex> lock(job.mutex);
+                if (--job.remaining == 0)
+                    job.done.notify_all();
+            });
+        }
+
+        while (true) {
+            {
+                std::lock_guard<std::mutex> lock(job.mutex);
+                if (job.remaining == 0)
+                    return;
+            }
+
+            if (!run_one(next_queue % size())) {
+                std::unique_lock<std::mutex> lock(job.mutex);
+                job.done.wait(lock, [&job] { return job.remaining == 0; });
+                return;
+            }
+        }
+    }
+
+  private:
+    struct work_queue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    struct batch {
+        std::mutex mutex;
+        std::condition_variable done;
+        int remaining = 0;
+    };
+
+    std::vector<std::unique_ptr<work_queue>> queues;
+    std::vector<std::thread> workers;
+    std::atomic<unsigned> next_queue{0};
+    std::atomic<int> queued{0};
+    std::mutex wake_mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+
+    void submit(std::function<void()> task) {
+        auto& queue = *queues[next_queue++ % queues.size()];
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.tasks.push_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> lock(wake_mutex);
+            queued++;
+        }
+        wake.notify_one();
+    }
+
+    bool pop_own(int index, std::function<void()>& task) {
+        auto& queue = *queues[index];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty())
+            return false;
+
+        task = std::move(queue.tasks.back());
+        queue.tasks.pop_back();
+        return true;
+    }
+
+    bool steal(int thief, std::function<void()>& task) {
+        int n = int(queues.size());
+        for (int offset = 1; offset < n; offset++) {
+            auto& queue = *queues[(thief + offset) % n];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.tasks.empty())
+                continue;
+
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+            return true;
+        }
+        return false;
+    }
+
+    bool run_one(int index) {
+        std::function<void()> task;
+        if (!pop_own(index, task) && !steal(index, task))
+            return false;
+
+        queued--;
+        task();
+        return true;
+    }
+
+    void worker_loop(int index) {
+        while (true) {
+            if (run_one(index))
+                continue;
+
+            std::unique_lock<std::mutex> lock(wake_mutex);
+            wake.wait(lock, [this] { return stopping || queued > 0; });
+            if (stopping && queued == 0)
+                return;
+        }
+    }
+};
+
+#endif
@@ -4,19 +4,22 @@
 #include "canbehit.h"
 #include "aabb.h"
 
+#include <cstdint>
+
 class triangle : public canbehit {
   public:
     triangle(const point3& v0, const point3& v1, const point3& v2, shared_ptr<material> mat)
-      : v0(v0), v1(v1), v2(v2), mat(mat)
+      : v0(v0), edge1(v1 - v0), edge2(v2 - v0), mat(mat)
     {
-        auto edge1 = v1 - v0;
-        auto edge2 = v2 - v0;
         normal = unit_vector(cross(edge1, edge2));
-        
+
         set_bounding_box();
     }
 
     virtual void set_bounding_box() {
+        auto v1 = v0 + edge1;
+        auto v2 = v0 + edge2;
+
         bbox = aabb(
             point3(
                 fmin(fmin(v0.x(), v1.x()), v2.x()),
@@ -35,8 +38,6 @@ class triangle : public canbehit {
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
         // Möller–Trumbore intersection algorithm
-        auto edge1 = v1 - v0;
-        auto edge2 = v2 - v0;
         auto h = cross(r.direction(), edge2);
         auto a = dot(edge1, h);
 
@@ -61,21 +62,127 @@ class triangle : public canbehit {
         if (!ray_t.contains(t))
             return false;
 
-        rec.t = t;
-        rec.p = r.at(t);
-        rec.mat = mat;
-        rec.set_face_normal(r, normal);
+        rec.set_hit(t, this);
         rec.u = u;
         rec.v = v;
-
         return true;
     }
 
+    void compute_interaction(const ray& r, hit_record& rec) const override {
+        rec.p = r.at(rec.t);
+        rec.mat = mat.get();
+        rec.set_face_normal(r, normal);
+        rec.dpdu = edge1;
+        rec.dpdv = edge2;
+    }
+
   private:
-    point3 v0, v1, v2;  // Vertices
+    point3 v0;          // First vertex
+    vec3 edge1, edge2;  // v1 - v0 and v2 - v0, precomputed for every hit test
     vec3 normal;        // Triangle normal
     shared_ptr<material> mat;
     aabb bbox;
 };
 
-#endif 
\ No newline at end of file
+// Triangles are intersected in packets of one SIMD register's width.
+#if defined(__AVX__)
+    const int triangle_packet_width = 8;
+#else
+    const int triangle_packet_width = 4;
+#endif
+
+// GCC/Clang vector types, which compile to SSE or AVX registers where available.
+template <int N> struct simd_lanes;
+
+template <> struct simd_lanes<4> {
+    typedef float   floats __attribute__((vector_size(16)));
+    typedef int32_t mask   __attribute__((vector_size(16)));
+};
+
+template <> struct simd_lanes<8> {
+    typedef float   floats __attribute__((vector_size(32)));
+    typedef int32_t mask   __attribute__((vector_size(32)));
+};
+
+// Up to N triangles in structure-of-arrays form with precomputed edges, so a
+// single Möller–Trumbore pass tests all of them. Unused lanes are degenerate and
+// carry the id no_triangle.
+template <int N>
+struct triangle_packet {
+    typedef typename simd_lanes<N>::floats lanes;
+    typedef typename simd_lanes<N>::mask   lane_mask;
+
+    static const uint32_t no_triangle = 0xffffffff;
+
+    lanes    v0[3];
+    lanes    edge1[3];
+    lanes    edge2[3];
+    uint32_t id[N];
+
+    triangle_packet() {
+        for (int axis = 0; axis < 3; axis++)
+            v0[axis] = edge1[axis] = edge2[axis] = lanes{};
+        for (int i = 0; i < N; i++)
+            id[i] = no_triangle;
+    }
+
+    void set(int lane, const point3& a, const point3& b, const point3& c, uint32_t triangle_id) {
+        for (int axis = 0; axis < 3; axis++) {
+            v0[axis][lane] = float(a[axis]);
+            edge1[axis][lane] = float(b[axis] - a[axis]);
+            edge2[axis][lane] = float(c[axis] - a[axis]);
+        }
+        id[lane] = triangle_id;
+    }
+
+    vec3 geometric_normal(int lane) const {
+        vec3 e1(edge1[0][lane], edge1[1][lane], edge1[2][lane]);
+        vec3 e2(edge2[0][lane], edge2[1][lane], edge2[2][lane]);
+        return unit_vector(cross(e1, e2));
+    }
+
+    // Tests the ray against every lane at once. On a hit inside ray_t, returns
+    // the closest lane and its distance and barycentric coordinates.
+    bool hit(const ray& r, const interval& ray_t, int& lane, double& t, double& u, double& v) const {
+        float ox = float(r.origin().x()), oy = float(r.origin().y()), oz = float(r.origin().z());
+        float dx = float(r.direction().x()), dy = float(r.direction().y()), dz = float(r.direction().z());
+
+        lanes hx = dy*edge2[2] - dz*edge2[1];
+        lanes hy = dz*edge2[0] - dx*edge2[2];
+        lanes hz = dx*edge2[1] - dy*edge2[0];
+        lanes a = edge1[0]*hx + edge1[1]*hy + edge1[2]*hz;
+        lanes f = 1.0f / a;
+
+        lanes sx = ox - v0[0], sy = oy - v0[1], sz = oz - v0[2];
+        lanes lane_u = f * (sx*hx + sy*hy + sz*hz);
+
+        lanes qx = sy*edge1[2] - sz*edge1[1];
+        lanes qy = sz*edge1[0] - sx*edge1[2];
+        lanes qz = sx*edge1[1] - sy*edge1[0];
+        lanes lane_v = f * (dx*qx + dy*qy + dz*qz);
+        lanes lane_t = f * (edge2[0]*qx + edge2[1]*qy + edge2[2]*qz);
+
+        lane_mask valid = ((a > 1e-8f) | (a < -1e-8f))
+                        & (lane_u >= 0.0f) & (lane_v >= 0.0f) & (lane_u + lane_v <= 1.0f)
+                        & (lane_t >= float(ray_t.min)) & (lane_t <= float(ray_t.max));
+
+        lane = -1;
+        float closest = INFINITY;
+        for (int i = 0; i < N; i++) {
+            if (valid[i] && lane_t[i] < closest) {
+                closest = lane_t[i];
+                lane = i;
+            }
+        }
+
+        if (lane < 0)
+            return false;
+
+        t = lane_t[lane];
+        u = lane_u[lane];
+        v = lane_v[lane];
+        return true;
+    }
+};
+
+#endif
@@ -2,6 +2,7 @@
 #define VEC3_H
 
 #include "commons.h"
+#include "sampler.h"
 
 class vec3 {
     public:
@@ -106,22 +107,41 @@ inline vec3 unit_vector(const vec3& v) {
     return v / v.length();
 }
 
+// The random directions and points below map one 2D sample each, so they
+// stay stratified under a low-discrepancy sampler.
+
+// Shirley's concentric mapping of the unit square onto the disk
 inline vec3 random_in_unit_disk() {
-    while (true) {
-        auto p = vec3(random_double(-1, 1), random_double(-1, 1), 0);
-        if (p.length_squared() < 1)
-            return p;
+    auto s = sample_2d();
+    double a = 2*s.u - 1, b = 2*s.v - 1;
+    if (a == 0 && b == 0)
+        return vec3(0, 0, 0);
+
+    double r, theta;
+    if (std::fabs(a) > std::fabs(b)) {
+        r = a;
+        theta = (pi / 4) * (b / a);
+    } else {
+        r = b;
+        theta = pi/2 - (pi / 4) * (a / b);
     }
+    return vec3(r * std::cos(theta), r * std::sin(theta), 0);
 }
 
 inline vec3 random_unit_vector() {
-    while (true) {
-        auto p = vec3::random(-1, 1);
-        auto lensq = p.length_squared();
+    auto s = sample_2d();
+    double z = 1 - 2*s.u;
+    double r = std::sqrt(std::fmax(0.0, 1 - z*z));
+    double phi = 2 * pi * s.v;
+    return vec3(r * std::cos(phi), r * std::sin(phi), z);
+}
 
-        if (1e-160 < lensq && lensq <= 1) 
-            return p / sqrt(lensq);
-    }
+// Cosine-weighted around +z
+inline vec3 random_cosine_direction() {
+    auto s = sample_2d();
+    auto phi = 2*pi*s.u;
+    auto r = std::sqrt(s.v);
+    return vec3(std::cos(phi)*r, std::sin(phi)*r, std::sqrt(1 - s.v));
 }
 
 inline vec3 random_on_hem(const vec3& normal) {